@@ -1,4 +1,9 @@
+#define _DEFAULT_SOURCE
+
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -28,6 +33,7 @@ typedef enum {
     ND_NE,      // !=
     ND_LT,      // <
     ND_LE,      // <=
+    ND_NEG,     // 単項 -
     ND_ASSIGN,  // =
     ND_LVAR,    // ローカル変数
     ND_NUM,     // 整数
@@ -52,13 +58,16 @@ typedef enum {
 typedef struct Token Token;
 typedef struct Node Node;
 typedef struct NDList NDList;
+typedef struct LVar LVar;
+typedef struct Function Function;
 
 struct Token {
     TokenKind kind; // トークンの型
     Token *next;    // 次の入力トークン
-    int val;        // kindがTK_NUMの場合、その数値
+    long val;       // kindがTK_NUMの場合、その数値
     char *str;      // トークンの文字列
     int len;        // トークンの文字列の長さ
+    unsigned hash;  // kindがTK_IDENTの場合、名前のハッシュ値
 };
 
 // 抽象構文木のNode型
@@ -66,8 +75,10 @@ struct Node {
     NodeKind kind;  // ノードの型
     Node *lhs;
     Node *rhs;
-    int val;        // kindがND_NUMの場合のみ使う
+    long val;       // kindがND_NUMの場合のみ使う
     int offset;     // kindがND_LVARの場合のみ使う
+    LVar *var;      // kindがND_LVARの場合の変数
+    int regs;       // 評価に必要なレジスタ数(lowerで使う)
 
     // "if", "while" and "for" statement
     Node *cond;
@@ -92,29 +103,357 @@ struct NDList {
     Node *node;
 };
 
+//
+// アリーナアロケータ
+//
+
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct {
+    char *name;
+    ArenaChunk *head;       // 確保したチャンクのリスト
+    ArenaChunk *current;    // 今切り出しているチャンク
+    char *ptr;              // currentの空き領域の先頭
+    char *end;
+    size_t count;           // 確保したオブジェクトの数
+    size_t bytes;           // 確保したバイト数
+    size_t reserved;        // チャンクとして確保済みのバイト数
+} Arena;
+
+// トークン, 抽象構文木(Node, NDList), ローカル変数(LVar)用のアリーナ
+extern _Thread_local Arena token_arena;
+extern _Thread_local Arena ast_arena;
+extern _Thread_local Arena symbol_arena;
+
+void *arena_alloc(Arena *arena, size_t size);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+void print_arena_stats();
+
+//
+// アセンブリの命令列
+//
+
+// x86-64のレジスタ(並びは機械語での番号と同じ)
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+} Reg;
+
+typedef enum {
+    OPD_NONE,
+    OPD_REG,    // レジスタ
+    OPD_IMM,    // 即値
+    OPD_MEM,    // [reg+index*scale+val]
+    OPD_LABEL,  // .Lend3 などのローカルラベル
+    OPD_SYM,    // 関数名などのシンボル
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    Reg reg;        // OPD_REGのレジスタ, OPD_MEMのベースレジスタ
+    long val;       // OPD_IMMの値, OPD_MEMのオフセット, OPD_LABELの番号
+    char *str;      // OPD_LABELの接頭辞, OPD_SYMの名前, コメントの文字列
+    int len;        // OPD_SYMの名前の長さ
+    Reg index;      // OPD_MEMのインデックスレジスタ
+    int scale;      // indexに掛ける1, 2, 4, 8。0ならインデックスなし
+} Operand;
+
+typedef enum {
+    I_MOV, I_LEA, I_ADD, I_SUB, I_IMUL, I_NEG, I_AND,
+    I_SHL, I_SHR, I_SAR,
+    I_CMP, I_CQO, I_IDIV,
+    I_IMUL1,        // rdx:rax = rax * dst
+    I_SETE, I_SETNE, I_SETL, I_SETLE, I_SETG, I_SETGE, // dstはal
+    I_MOVZB,        // srcはal
+    I_PUSH, I_POP,
+    I_JMP,
+    I_JE, I_JNE, I_JL, I_JLE, I_JG, I_JGE, // 条件付きジャンプ
+    I_CALL, I_RET,
+    I_LABEL,        // dstのラベルを定義
+    I_GLOBL,        // .globl dst
+    I_ALIGN,        // .p2align dst。dstは2の冪の指数
+    I_COMMENT,      // dst.strのコメント
+    I_NOP,          // peepholeで消された命令
+} Opcode;
+
+typedef struct {
+    Opcode op;
+    Operand dst;
+    Operand src;
+} Insn;
+
+// codegenが作った命令列
+extern _Thread_local Insn *insns;
+extern _Thread_local int num_insns;
+extern _Thread_local bool asm_comments;
+
+Operand reg_op(Reg reg);
+Operand imm_op(long val);
+Operand mem_op(Reg base, long offset);
+Operand index_op(Reg base, Reg index, int scale, long offset);
+Operand label_op(char *prefix, int index);
+Operand sym_op(char *name, int len);
+void emit(Opcode op, Operand dst, Operand src);
+void emit_comment(char *text);
+void index_labels();
+int find_label(Operand *label);
+void print_asm();
+
+//
+// 機械語とオブジェクトファイル
+//
+
+typedef struct {
+    char *name;
+    int len;
+    int offset;     // textの中で定義された位置。未定義なら-1
+    bool global;
+} Symbol;
+
+// call命令のrel32が指すシンボル
+typedef struct {
+    int offset;     // rel32のtextの中での位置
+    int symbol;     // symbolsの添字
+} Reloc;
+
+extern _Thread_local unsigned char *text;
+extern _Thread_local int text_len;
+extern _Thread_local Symbol *symbols;
+extern _Thread_local int num_symbols;
+extern _Thread_local Reloc *relocs;
+extern _Thread_local int num_relocs;
+
+void encode();
+void write_elf();
+void write_out(char *buf, size_t len);
+
+// 出力先のバッファ
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t len;
+} Sink;
+
+extern _Thread_local Sink *sink;
+void load_library(char *path);
+long run_jit();
+
+//
+// 中間表現(IR)
+// 基本ブロックの列で、値は仮想レジスタ v1, v2, ... に置く
+// 変数はIR_LOADとIR_STOREでだけ読み書きする
+//
+
+typedef enum {
+    IR_IMM,     // dst = imm
+    IR_MOV,     // dst = a
+    IR_ADD,     // dst = a + b
+    IR_SUB,     // dst = a - b
+    IR_MUL,     // dst = a * b
+    IR_DIV,     // dst = a / b
+    IR_EQ,      // dst = a == b
+    IR_NE,      // dst = a != b
+    IR_LT,      // dst = a < b
+    IR_LE,      // dst = a <= b
+    IR_NEG,     // dst = -a
+    IR_LOAD,    // dst = var
+    IR_STORE,   // var = a
+    IR_CALL,    // dst = name(args...)
+    IR_JMP,     // goto then
+    IR_BR,      // if (a) goto then; else goto els
+    IR_RET,     // return a
+    IR_NOP,     // 最適化で消された命令
+} IROp;
+
+typedef struct {
+    IROp op;
+    int dst;        // 書き込む仮想レジスタ。なければ0
+    int a, b;       // 読む仮想レジスタ。なければ0
+    long imm;       // IR_IMMの値
+    LVar *var;      // IR_LOAD, IR_STOREの変数
+    char *name;     // IR_CALLの関数名
+    int len;
+    int args;       // IR_CALLの引数のir_argsでの先頭の位置
+    int num_args;
+    int then, els;  // 分岐先のブロック
+    unsigned saved; // IR_CALLの前後で退避する物理レジスタ(regallocで決める)
+} IR;
+
+// 基本ブロック。命令はirs[start]からirs[end - 1]まで
+// 最後の命令だけがIR_JMP, IR_BR, IR_RETのどれか
+typedef struct {
+    int start;
+    int end;
+    bool reachable;
+    bool loop;      // ループの先頭。後ろから飛んでくるので揃えて置く
+} Block;
+
+// lowerが作ったIR
+// irsはブロックの配置順に並んでいて、命令の添字がそのまま位置になる
+extern _Thread_local IR *irs;
+extern _Thread_local int num_irs;
+extern _Thread_local int *ir_args;
+extern _Thread_local Block *blocks;
+extern _Thread_local int num_blocks;
+extern _Thread_local int *layout;      // ブロックの配置順
+extern _Thread_local int num_layout;
+extern _Thread_local int num_vregs;
+
+void reset_ir();
+int new_vreg();
+int new_block();
+void start_block(int b);
+IR *emit_ir(IROp op);
+int reserve_args(int n);
+int num_uses(IR *ir);
+int ir_use(IR *ir, int i);
+int successors(int b, int *succ);
+void dump_ir(Function *fn);
+void verify_ir();
+
+// 生存解析(analyze_ir)の結果
+// ブロックをまたいで生きる仮想レジスタだけに通し番号を振ってビット集合で持つ
+extern _Thread_local int *vreg_global;     // 通し番号。ブロックの中で閉じていれば-1
+extern _Thread_local int num_globals;
+extern _Thread_local int live_words;       // ブロックごとのビット集合の語数
+extern _Thread_local unsigned long *block_live_in;
+extern _Thread_local unsigned long *block_live_out;
+
+void analyze_ir();
+bool live_in_block(int b, int g);
+bool live_out_block(int b, int g);
+void eliminate_dead_code();
+
+// 命令選択
+extern _Thread_local Operand *vreg_tile;   // 使う側に埋め込む即値か変数。埋め込まなければOPD_NONE
+void select_operands();
+
+// 仮想レジスタの割り当て
+extern _Thread_local Operand *vreg_loc;    // 各仮想レジスタの置き場所(レジスタかスタック)
+extern _Thread_local int spill_size;        // 追い出した値の領域のバイト数
+extern _Thread_local unsigned saved_regs;   // 変数を置くのでプロローグで退避するレジスタ
+extern _Thread_local int frame_size;        // 退避したレジスタと、メモリに置く変数の領域のバイト数
+void promote_vars();
+Operand var_loc(LVar *var);
+void allocate_registers();
+
 // プロトタイプ宣言
 void program();
+NDList *new_ndlist();
+void fold();
+void lower(Function *fn);
+void codegen(Function *fn);
+void peephole();
+void print_peephole_stats();
+
 
+//
+// 統計(--stats)
+//
 
-Token *tokenize(char *user_input);
-void gen_stmt(Node *node);
-void error_at(char *loc, char *fmt, ...);
-void error(char *fmt, ...);
+typedef enum {
+    PHASE_READ,
+    PHASE_TOKENIZE,
+    PHASE_PARSE,
+    PHASE_FOLD,
+    PHASE_LOWER,
+    PHASE_CODEGEN,
+    PHASE_PEEPHOLE,
+    PHASE_EMIT,
+    NUM_PHASES,
+} Phase;
+
+typedef struct {
+    long tokens;    // 作ったオブジェクトの数
+    long nodes;
+    long ndlists;
+    long lvars;
+    long irs;
+    long insns;     // 出力した命令の数
+    long lines;     // 出力した行数
+    long bytes;     // 出力したバイト数
+} Stats;
+
+extern _Thread_local Stats stats;
+
+void begin_phase(Phase phase);
+void end_phase(Phase phase);
+void close_phases();
+void print_stats(char *path);
+
+char *read_file(char *path);
+void free_file(char *buf);
+char *read_record(FILE *fp, int delim);
+Token *tokenize(char *filename, char *user_input);
+void select_scanner(char *name);
+char *scanner_name();
+char *skip_space(char *p);
+char *skip_ident(char *p);
+long read_decimal(char *p, char **end);
+_Noreturn void error_at(char *loc, char *fmt, ...);
+_Noreturn void error(char *fmt, ...);
+
+// エラーのときにexitせずに戻る先と、そのメッセージ
+#define ERROR_MAX 1024
+extern _Thread_local jmp_buf *error_jmp;
+extern _Thread_local char error_message[ERROR_MAX];
+
+// スレッドごとに使い回しているバッファを解放する(ninecc_thread_cleanup)
+void free_parser();
+void free_symtab();
+void free_asm();
+void free_peephole();
+void free_emit();
+void free_encode();
+void free_elf();
+void free_ir();
+void free_regalloc();
+void free_codegen();
+void free_isel();
 
 // グローバル変数の宣言
 // 現在着目しているトークン
-extern Token *token;
+extern _Thread_local Token *token;
 
 // stmt nodeを保存しておくグローバル変数
-extern Node *code[100];
+// NULL終端の可変長配列。関数の外に書いた文でmainになる
+extern _Thread_local Node **code;
 
-typedef struct LVar LVar;
 struct LVar {
     LVar *next; // 次の変数かNULL
     char *name; // 変数の名前
     int len;    // 名前の長さ
     int offset; // RBPからのオフセット
+    int function;       // 宣言した関数の番号
+    long uses;          // 読み書きの回数。ループの中は深さに応じて重くする(lowerが数える)
+    unsigned hash;      // 名前のハッシュ値
+    LVar *shadow;       // 外側のスコープにある同名の変数
+    LVar *scope_next;   // 同じスコープで宣言された変数
 };
 
+// 記号表
+unsigned hash_name(char *name, int len);
+LVar *find_lvar(Token *tok);
+void declare_lvar(LVar *var);
+void reset_symtab();
+void enter_scope();
+void enter_function_scope();
+void leave_scope();
+
 // ローカル変数 連結リストの先頭のポインタ
-extern LVar *locals;
\ No newline at end of file
+extern _Thread_local LVar *locals;
+
+// 関数定義
+struct Function {
+    Function *next;
+    char *name;
+    int len;
+    LVar **params;  // 引数の変数。先頭の6つはレジスタで渡される
+    int num_params;
+    LVar *locals;   // 引数を含む変数のリスト。先頭のoffsetが変数の領域の大きさ
+    Node **code;    // NULL終端の文の並び
+};
+
+// program()が作った関数のリスト。定義した順に並ぶ
+extern _Thread_local Function *functions;
\ No newline at end of file
@@ -0,0 +1,106 @@
+#include "9cc.h"
+
+//
+// アリーナアロケータ
+// 小さなオブジェクトを大きなチャンクから切り出して確保する
+// 個別の解放はせず、arena_resetでアリーナごとまとめて再利用する
+//
+
+#define CHUNK_SIZE (1 << 20)
+#define ALIGN 8
+
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t size;        // dataの大きさ
+    char data[];
+};
+
+_Thread_local Arena token_arena = {"token"};
+_Thread_local Arena ast_arena = {"ast"};
+_Thread_local Arena symbol_arena = {"symbol"};
+
+static ArenaChunk *new_chunk(size_t size) {
+    if (size < CHUNK_SIZE)
+        size = CHUNK_SIZE;
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + size);
+    if (chunk == NULL)
+        error("メモリを確保できません");
+    chunk->next = NULL;
+    chunk->size = size;
+    return chunk;
+}
+
+// 次のチャンクに移る
+// resetで残しておいたチャンクが使えればそれを使う
+static void next_chunk(Arena *arena, size_t size) {
+    ArenaChunk *chunk = arena->current ? arena->current->next : arena->head;
+    while (chunk && chunk->size < size)
+        chunk = chunk->next;
+
+    if (chunk == NULL) {
+        chunk = new_chunk(size);
+        // 先頭かcurrentの直後に挿入する
+        if (arena->current) {
+            chunk->next = arena->current->next;
+            arena->current->next = chunk;
+        } else {
+            chunk->next = arena->head;
+            arena->head = chunk;
+        }
+        arena->reserved += chunk->size;
+    }
+
+    arena->current = chunk;
+    arena->ptr = chunk->data;
+    arena->end = chunk->data + chunk->size;
+}
+
+// 0で初期化されたsizeバイトの領域を返す
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+    if ((size_t)(arena->end - arena->ptr) < size)
+        next_chunk(arena, size);
+
+    void *p = arena->ptr;
+    arena->ptr += size;
+    arena->count++;
+    arena->bytes += size;
+    memset(p, 0, size);
+    return p;
+}
+
+// アリーナから確保した全てのオブジェクトをまとめて捨てる
+// チャンクは解放せずに次の確保で使い回す
+void arena_reset(Arena *arena) {
+    arena->current = NULL;
+    arena->ptr = NULL;
+    arena->end = NULL;
+    arena->count = 0;
+    arena->bytes = 0;
+}
+
+// チャンクもOSに返す
+// 確保数とバイト数は統計のために残しておく
+void arena_free(Arena *arena) {
+    ArenaChunk *chunk = arena->head;
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+    arena->current = NULL;
+    arena->ptr = NULL;
+    arena->end = NULL;
+    arena->reserved = 0;
+}
+
+void print_arena_stats() {
+    Arena *arenas[] = {&token_arena, &ast_arena, &symbol_arena};
+    fprintf(stderr, "arena:\n");
+    for (int i = 0; i < sizeof(arenas) / sizeof(*arenas); i++) {
+        Arena *arena = arenas[i];
+        fprintf(stderr, "  %-8s %10zu allocs %12zu bytes %12zu reserved\n",
+                arena->name, arena->count, arena->bytes, arena->reserved);
+    }
+}
@@ -0,0 +1,126 @@
+#include "9cc.h"
+
+//
+// codegenが出力する命令列
+//
+
+_Thread_local Insn *insns;
+_Thread_local int num_insns;
+static _Thread_local int capacity;
+
+// 偽ならコメントを命令列に入れない
+_Thread_local bool asm_comments = true;
+
+Operand reg_op(Reg reg) {
+    Operand op = {OPD_REG};
+    op.reg = reg;
+    return op;
+}
+
+Operand imm_op(long val) {
+    Operand op = {OPD_IMM};
+    op.val = val;
+    return op;
+}
+
+Operand mem_op(Reg base, long offset) {
+    Operand op = {OPD_MEM};
+    op.reg = base;
+    op.val = offset;
+    return op;
+}
+
+Operand index_op(Reg base, Reg index, int scale, long offset) {
+    Operand op = mem_op(base, offset);
+    op.index = index;
+    op.scale = scale;
+    return op;
+}
+
+Operand label_op(char *prefix, int index) {
+    Operand op = {OPD_LABEL};
+    op.str = prefix;
+    op.val = index;
+    return op;
+}
+
+Operand sym_op(char *name, int len) {
+    Operand op = {OPD_SYM};
+    op.str = name;
+    op.len = len;
+    return op;
+}
+
+void emit(Opcode op, Operand dst, Operand src) {
+    if (num_insns == capacity) {
+        capacity = capacity ? capacity * 2 : 1024;
+        insns = realloc(insns, sizeof(Insn) * capacity);
+        if (insns == NULL)
+            error("メモリを確保できません");
+    }
+    Insn *insn = &insns[num_insns++];
+    insn->op = op;
+    insn->dst = dst;
+    insn->src = src;
+}
+
+void emit_comment(char *text) {
+    if (!asm_comments)
+        return;
+    Operand op = {OPD_NONE};
+    op.str = text;
+    emit(I_COMMENT, op, op);
+}
+
+// ラベルから命令の位置を引くためのハッシュ表
+static _Thread_local int *label_pos;
+static _Thread_local int label_cap;
+
+static unsigned label_hash(Operand *label) {
+    unsigned h = (unsigned)label->val * 2654435761u;
+    for (char *p = label->str; *p; p++)
+        h = h * 31 + *p;
+    return h;
+}
+
+static int *find_label_slot(Operand *label) {
+    for (unsigned h = label_hash(label);; h++) {
+        int *slot = &label_pos[h & (label_cap - 1)];
+        if (*slot < 0)
+            return slot;
+        Operand *op = &insns[*slot].dst;
+        if (op->val == label->val && !strcmp(op->str, label->str))
+            return slot;
+    }
+}
+
+// 今の命令列にあるローカルラベルの位置を表に入れる
+// 命令を足したり詰めたりしたら作り直す
+void index_labels() {
+    label_cap = 16;
+    while (label_cap < num_insns * 2)
+        label_cap *= 2;
+    label_pos = realloc(label_pos, sizeof(int) * label_cap);
+    if (label_pos == NULL)
+        error("メモリを確保できません");
+    for (int i = 0; i < label_cap; i++)
+        label_pos[i] = -1;
+
+    for (int i = 0; i < num_insns; i++)
+        if (insns[i].op == I_LABEL && insns[i].dst.kind == OPD_LABEL)
+            *find_label_slot(&insns[i].dst) = i;
+}
+
+// labelを定義しているI_LABEL命令の位置。なければ-1
+int find_label(Operand *label) {
+    return *find_label_slot(label);
+}
+
+// スレッドの作業領域を解放する
+void free_asm() {
+    free(insns);
+    free(label_pos);
+    insns = NULL;
+    label_pos = NULL;
+    num_insns = capacity = label_cap = 0;
+}
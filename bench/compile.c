@@ -0,0 +1,331 @@
+#include "../9cc.h"
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+// コンパイラのフェーズごとの時間を測る
+// 形の違う合成プログラムを大きさを変えて生成し、
+// tokenize, program, fold, codegen, peephole, 出力をそれぞれ計る
+//
+// usage: bench/compile [-r 回数] [-s 形] [-j out.json] [-c out.csv] [文の数...]
+//
+// コンパイラはグローバル変数に状態を持つので、1回ごとにforkした子で
+// コンパイルし、計った時間をパイプで親に返す。回数の中で最小の値を使う。
+//
+
+// ファイルは読まないのでPHASE_READは測らない
+#define FIRST_PHASE PHASE_TOKENIZE
+
+static char *phase_name[] = {
+    [PHASE_TOKENIZE] = "tokenize",
+    [PHASE_PARSE] = "program",
+    [PHASE_FOLD] = "fold",
+    [PHASE_LOWER] = "lower",
+    [PHASE_CODEGEN] = "codegen",
+    [PHASE_PEEPHOLE] = "peephole",
+    [PHASE_EMIT] = "emit",
+};
+
+typedef struct {
+    double time[NUM_PHASES];
+    long tokens;
+    long insns;
+} Result;
+
+//
+// 合成プログラムの生成
+//
+
+static char *buf;
+static size_t len;
+static size_t capacity;
+
+static void out(char *fmt, ...) {
+    va_list ap;
+    for (;;) {
+        va_start(ap, fmt);
+        int n = vsnprintf(buf + len, capacity - len, fmt, ap);
+        va_end(ap);
+        // スキャナが読むNULの後ろの余白も残しておく
+        if (len + n + 32 < capacity) {
+            len += n;
+            return;
+        }
+        capacity = capacity ? capacity * 2 : 1 << 20;
+        buf = realloc(buf, capacity);
+        if (buf == NULL)
+            error("メモリを確保できません");
+    }
+}
+
+// 右に深くネストした式。レジスタが足りずに退避が起きる
+static void gen_exprs(int n) {
+    static char *ops[] = {"+", "*", "-", "/"};
+    out("a = 1;\nb = 2;\n");
+    for (int i = 0; i < n; i++) {
+        out("a = ");
+        for (int d = 0; d < 32; d++)
+            out("(%c %s ", "ab"[d % 2], ops[d % 4]);
+        out("%d", i + 1);
+        for (int d = 0; d < 32; d++)
+            out(")");
+        out(";\n");
+    }
+}
+
+// 単純な文の長い列
+static void gen_stmts(int n) {
+    out("x = 0;\n");
+    for (int i = 0; i < n; i++)
+        out("x = x + %d;\n", i % 100);
+}
+
+// n個の異なるローカル変数
+static void gen_locals(int n) {
+    out("v0 = 0;\n");
+    for (int i = 1; i < n; i++)
+        out("v%d = v%d + %d;\n", i, i - 1, i % 100);
+}
+
+// 入れ子になったループ
+static void gen_loops(int n) {
+    out("s = 0;\n");
+    for (int i = 0; i < n; i++)
+        out("for (i = 0; i < %d; i = i + 1) { "
+            "for (j = 0; j < i; j = j + 1) { "
+            "k = j; while (k > 0) { s = s + k; k = k - 1; } } }\n", i % 10);
+}
+
+// 引数のある関数呼び出し
+static void gen_calls(int n) {
+    out("x = 1;\ny = 2;\n");
+    for (int i = 0; i < n; i++)
+        out("x = foo%d(x, y + %d, x * y, 3, bar(x, y), y);\n", i % 16, i % 100);
+}
+
+typedef struct {
+    char *name;
+    void (*gen)(int n);
+} Shape;
+
+static Shape shapes[] = {
+    {"exprs", gen_exprs},
+    {"stmts", gen_stmts},
+    {"locals", gen_locals},
+    {"loops", gen_loops},
+    {"calls", gen_calls},
+};
+
+static char *generate(Shape *shape, int n) {
+    len = 0;
+    shape->gen(n);
+    out("return 0;\n");
+    return buf;
+}
+
+//
+// 計測
+//
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 子プロセスの中で1回コンパイルする
+static Result compile(char *input) {
+    Result r = {0};
+    double t = now();
+
+    token = tokenize("bench", input);
+    r.time[PHASE_TOKENIZE] = now() - t;
+    for (Token *tok = token; tok; tok = tok->next)
+        r.tokens++;
+
+    t = now();
+    program();
+    arena_free(&token_arena);
+    r.time[PHASE_PARSE] = now() - t;
+
+    t = now();
+    fold();
+    r.time[PHASE_FOLD] = now() - t;
+
+    for (Function *fn = functions; fn; fn = fn->next) {
+        t = now();
+        lower(fn);
+        r.time[PHASE_LOWER] += now() - t;
+
+        t = now();
+        codegen(fn);
+        r.time[PHASE_CODEGEN] += now() - t;
+    }
+
+    t = now();
+    peephole();
+    r.time[PHASE_PEEPHOLE] = now() - t;
+    r.insns = num_insns;
+
+    // 出力は捨てる
+    int fd = open("/dev/null", O_WRONLY);
+    dup2(fd, STDOUT_FILENO);
+    t = now();
+    print_asm();
+    r.time[PHASE_EMIT] = now() - t;
+    return r;
+}
+
+static bool run(char *input, Result *r) {
+    int fds[2];
+    if (pipe(fds) < 0)
+        error("pipeに失敗しました");
+
+    pid_t pid = fork();
+    if (pid < 0)
+        error("forkに失敗しました");
+    if (pid == 0) {
+        Result res = compile(input);
+        write(fds[1], &res, sizeof(res));
+        _exit(0);
+    }
+
+    close(fds[1]);
+    ssize_t n = read(fds[0], r, sizeof(*r));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    return n == sizeof(*r) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+typedef struct {
+    char *shape;
+    int size;
+    size_t bytes;
+    Result r;
+    double total;
+} Row;
+
+static double total(Result *r) {
+    double sum = 0;
+    for (int i = FIRST_PHASE; i < NUM_PHASES; i++)
+        sum += r->time[i];
+    return sum;
+}
+
+static void write_csv(char *path, Row *rows, int nrows) {
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        error("%s: %s", path, strerror(errno));
+    fprintf(fp, "shape,size,bytes,tokens,insns");
+    for (int i = FIRST_PHASE; i < NUM_PHASES; i++)
+        fprintf(fp, ",%s_ms", phase_name[i]);
+    fprintf(fp, ",total_ms,mb_per_s\n");
+
+    for (Row *row = rows; row < rows + nrows; row++) {
+        fprintf(fp, "%s,%d,%zu,%ld,%ld", row->shape, row->size, row->bytes,
+                row->r.tokens, row->r.insns);
+        for (int i = FIRST_PHASE; i < NUM_PHASES; i++)
+            fprintf(fp, ",%.3f", row->r.time[i] * 1e3);
+        fprintf(fp, ",%.3f,%.2f\n", row->total * 1e3, row->bytes / 1e6 / row->total);
+    }
+    fclose(fp);
+}
+
+static void write_json(char *path, Row *rows, int nrows) {
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        error("%s: %s", path, strerror(errno));
+    fprintf(fp, "[\n");
+    for (Row *row = rows; row < rows + nrows; row++) {
+        fprintf(fp, "  {\"shape\": \"%s\", \"size\": %d, \"bytes\": %zu, "
+                "\"tokens\": %ld, \"insns\": %ld, \"ms\": {",
+                row->shape, row->size, row->bytes, row->r.tokens, row->r.insns);
+        for (int i = FIRST_PHASE; i < NUM_PHASES; i++)
+            fprintf(fp, "%s\"%s\": %.3f", i > FIRST_PHASE ? ", " : "", phase_name[i], row->r.time[i] * 1e3);
+        fprintf(fp, "}, \"total_ms\": %.3f, \"mb_per_s\": %.2f}%s\n",
+                row->total * 1e3, row->bytes / 1e6 / row->total,
+                row < rows + nrows - 1 ? "," : "");
+    }
+    fprintf(fp, "]\n");
+    fclose(fp);
+}
+
+int main(int argc, char **argv) {
+    int rounds = 3;
+    char *only = NULL;
+    char *json = NULL;
+    char *csv = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:s:j:c:")) != -1) {
+        switch (opt) {
+        case 'r': rounds = atoi(optarg); break;
+        case 's': only = optarg; break;
+        case 'j': json = optarg; break;
+        case 'c': csv = optarg; break;
+        default:
+            fprintf(stderr, "usage: bench/compile [-r rounds] [-s shape] "
+                    "[-j out.json] [-c out.csv] [size...]\n");
+            return 1;
+        }
+    }
+
+    int default_sizes[] = {1000, 10000, 100000};
+    int *sizes = default_sizes;
+    int nsizes = 3;
+    if (optind < argc) {
+        nsizes = argc - optind;
+        sizes = calloc(nsizes, sizeof(int));
+        for (int i = 0; i < nsizes; i++)
+            sizes[i] = atoi(argv[optind + i]);
+    }
+
+    int nshapes = sizeof(shapes) / sizeof(*shapes);
+    Row *rows = calloc(nshapes * nsizes, sizeof(Row));
+    int nrows = 0;
+
+    printf("%-7s %8s %10s", "shape", "size", "bytes");
+    for (int i = FIRST_PHASE; i < NUM_PHASES; i++)
+        printf(" %9s", phase_name[i]);
+    printf(" %9s %8s\n", "total", "MB/s");
+
+    for (Shape *shape = shapes; shape < shapes + nshapes; shape++) {
+        if (only && strcmp(only, shape->name))
+            continue;
+        for (int s = 0; s < nsizes; s++) {
+            char *input = generate(shape, sizes[s]);
+            Row *row = &rows[nrows++];
+            row->shape = shape->name;
+            row->size = sizes[s];
+            row->bytes = len;
+
+            for (int i = 0; i < rounds; i++) {
+                Result r;
+                // 子プロセスがstdioのバッファを二重に書き出さないように
+                fflush(stdout);
+                if (!run(input, &r))
+                    error("%s %dのコンパイルに失敗しました", shape->name, sizes[s]);
+                // フェーズごとに最小の時間を取る
+                for (int p = FIRST_PHASE; p < NUM_PHASES; p++)
+                    if (i == 0 || r.time[p] < row->r.time[p])
+                        row->r.time[p] = r.time[p];
+                row->r.tokens = r.tokens;
+                row->r.insns = r.insns;
+            }
+            row->total = total(&row->r);
+
+            printf("%-7s %8d %10zu", row->shape, row->size, row->bytes);
+            for (int i = FIRST_PHASE; i < NUM_PHASES; i++)
+                printf(" %7.2fms", row->r.time[i] * 1e3);
+            printf(" %7.2fms %8.2f\n", row->total * 1e3, row->bytes / 1e6 / row->total);
+        }
+    }
+
+    if (csv)
+        write_csv(csv, rows, nrows);
+    if (json)
+        write_json(json, rows, nrows);
+    return 0;
+}
@@ -0,0 +1,27 @@
+#!/bin/bash
+# 生成したコードのループの実行時間を測る
+# usage: bench/loops.sh [コンパイラ]
+# 古いコミットで作った9ccを渡すと、ループの生成方法による差を比べられる
+cc9=${1:-./9cc}
+
+# 名前 期待する終了コード プログラム
+kernels=(
+    "count $(( 200000000 % 256 ))|i = 0; while (i < 200000000) i = i + 1; return i;"
+    "sum $(( (99999999 * 100000000 / 2) % 256 ))|s = 0; for (i = 0; i < 100000000; i = i + 1) s = s + i; return s;"
+    "nested $(( (9999 * 10000 / 2 * 10000) % 256 ))|s = 0; for (i = 0; i < 10000; i = i + 1) for (j = 0; j < 10000; j = j + 1) s = s + j; return s;"
+    "countdown $(( 300000000 % 256 ))|n = 100000000; c = 0; while (n > 0) { c = c + 3; n = n - 1; } return c;"
+    "divide 19|s = 0; for (i = 0; i < 100000000; i = i + 1) s = s + i / 7; return s;"
+)
+
+for kernel in "${kernels[@]}"; do
+    set -- ${kernel%%|*}
+    echo "${kernel#*|}" | "$cc9" --no-comments - > tmp-loops.s || exit 1
+    cc -o tmp-loops tmp-loops.s 2> /dev/null || exit 1
+    ./bench/runstat ./tmp-loops 2> tmp-loops.time
+    actual="$?"
+    if [ "$actual" != "$2" ]; then
+        echo "$1 => $2 expected, but got $actual"
+        exit 1
+    fi
+    printf '%-10s %s\n' "$1" "$(cut -d" " -f2-3 tmp-loops.time)"
+done
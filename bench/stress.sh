@@ -0,0 +1,23 @@
+#!/bin/bash
+# 大量の文を含むプログラムをコンパイルして、時間と最大RSSを測る
+# usage: bench/stress.sh [文の数]
+n=${1:-1000000}
+
+awk -v n="$n" 'BEGIN {
+    print "x = 0;"
+    for (i = 2; i < n; i++)
+        print "x = x + 1;"
+    print "return x;"
+}' > tmp-stress.c
+
+./bench/runstat ./9cc --no-comments tmp-stress.c > tmp-stress.s || exit 1
+cc -o tmp-stress tmp-stress.s
+./tmp-stress
+actual="$?"
+expected=$(( (n - 2) % 256 ))
+
+if [ "$actual" != "$expected" ]; then
+    echo "$n statements => $expected expected, but got $actual"
+    exit 1
+fi
+echo "$n statements => $actual"
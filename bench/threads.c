@@ -0,0 +1,155 @@
+#define _DEFAULT_SOURCE
+#include "../ninecc.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+// libnineccを複数のスレッドから同時に呼んだときのスループットを測る
+// スレッド数を1, 2, 4, ... と増やし、それぞれ同じ数のプログラムをコンパイルする
+//
+// usage: bench/threads [-n プログラム数] [-t 最大スレッド数]
+//
+// 出力が1スレッドで作った参照と同じかも確かめ、違えば失敗する。
+// 各スレッドは不正なプログラムも1つコンパイルして、エラーが返ることを確かめる。
+//
+
+#define NUM_SOURCES 64
+#define OUT_CAP (1 << 20)
+
+static char *sources[NUM_SOURCES];
+static char *expected[NUM_SOURCES];
+static long expected_len[NUM_SOURCES];
+
+static int units = 20000;
+
+typedef struct {
+    pthread_t thread;
+    int begin, end;
+    int mismatches;
+    bool error_ok;
+} Worker;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// i番目のプログラム。大きさと形を少しずつ変える
+static char *gen_source(int i) {
+    size_t cap = 1 << 16, len = 0;
+    char *buf = malloc(cap);
+    len += snprintf(buf + len, cap - len, "a = %d;\nb = 0;\n", i);
+    for (int j = 0; j < 8 + i % 16; j++)
+        len += snprintf(buf + len, cap - len,
+                        "while (a > %d) { b = b + a * %d - (a / 3); a = a - 1; }\n"
+                        "if (b == %d) b = 1; else b = b + (a + %d) * (b - %d);\n",
+                        j, j + 1, j, i, j);
+    snprintf(buf + len, cap - len, "return b;\n");
+    return buf;
+}
+
+static void *work(void *arg) {
+    Worker *w = arg;
+    Compiler *c = ninecc_new();
+    char *out = malloc(OUT_CAP);
+
+    for (int i = w->begin; i < w->end; i++) {
+        int k = i % NUM_SOURCES;
+        long n = ninecc_compile(c, "-", sources[k], out, OUT_CAP);
+        if (n != expected_len[k] || memcmp(out, expected[k], n))
+            w->mismatches++;
+    }
+
+    // エラーでもプロセスは終わらず、メッセージが返る
+    long n = ninecc_compile(c, "-", "a = (1 + ;", out, OUT_CAP);
+    w->error_ok = n == -1 && strstr(ninecc_error(c), "^") != NULL;
+
+    free(out);
+    ninecc_free(c);
+    ninecc_thread_cleanup();
+    return NULL;
+}
+
+// units個のプログラムをthreads個のスレッドで分けてコンパイルする
+static double run(int threads, bool *ok) {
+    Worker *ws = calloc(threads, sizeof(Worker));
+    double start = now();
+    for (int t = 0; t < threads; t++) {
+        ws[t].begin = (long)units * t / threads;
+        ws[t].end = (long)units * (t + 1) / threads;
+        pthread_create(&ws[t].thread, NULL, work, &ws[t]);
+    }
+    int mismatches = 0;
+    bool error_ok = true;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(ws[t].thread, NULL);
+        mismatches += ws[t].mismatches;
+        error_ok = error_ok && ws[t].error_ok;
+    }
+    double elapsed = now() - start;
+    free(ws);
+
+    if (mismatches)
+        fprintf(stderr, "threads=%d: 出力が %d 個違います\n", threads, mismatches);
+    if (!error_ok)
+        fprintf(stderr, "threads=%d: エラーが返りませんでした\n", threads);
+    *ok = !mismatches && error_ok;
+    return elapsed;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            units = atoi(argv[++i]);
+            continue;
+        }
+        if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            max_threads = atoi(argv[++i]);
+            continue;
+        }
+        fprintf(stderr, "usage: bench/threads [-n units] [-t max_threads]\n");
+        return 1;
+    }
+    if (max_threads < 1)
+        max_threads = 1;
+
+    // 参照の出力はメインスレッドで作る
+    Compiler *c = ninecc_new();
+    char *out = malloc(OUT_CAP);
+    for (int i = 0; i < NUM_SOURCES; i++) {
+        sources[i] = gen_source(i);
+        expected_len[i] = ninecc_compile(c, "-", sources[i], out, OUT_CAP);
+        if (expected_len[i] < 0 || expected_len[i] > OUT_CAP) {
+            fprintf(stderr, "参照をコンパイルできません: %s\n", ninecc_error(c));
+            return 1;
+        }
+        expected[i] = malloc(expected_len[i]);
+        memcpy(expected[i], out, expected_len[i]);
+    }
+    free(out);
+    ninecc_free(c);
+
+    printf("%8s %12s %8s\n", "threads", "units/s", "speedup");
+    bool ok = true;
+    double base = 0;
+    for (int t = 1;; t *= 2) {
+        if (t > max_threads)
+            t = max_threads;
+        bool pass;
+        double rate = units / run(t, &pass);
+        ok = ok && pass;
+        if (t == 1)
+            base = rate;
+        printf("%8d %12.0f %7.2fx\n", t, rate, rate / base);
+        if (t == max_threads)
+            break;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,60 @@
+#include "../9cc.h"
+#include <time.h>
+
+//
+// トークナイザ単体のスループットを測る
+// usage: bench/tokenize [MB] [回数] [scalar|sse2|avx2]
+//
+
+static char *sample[] = {
+    "foo_bar12 = foo_bar12 + 12345 * (x - 7);\n",
+    "if (alpha <= beta) return gamma; else delta = 0;\n",
+    "for (i = 0; i < 1000; i = i + 1) { sum = sum + i / 3; }\n",
+    "while (counter != 0) counter = counter - 1;\n",
+    "result = myadd(first_argument, second_argument, 42);\n",
+    "    x_1 == y_2;  z >= 100; w > v;\n",
+    // 生成されたコードによくある深いインデントと長い名前
+    "                                        generated_temporary_value_000123 = generated_temporary_value_000122 + 1;\n",
+    "                                                                if (generated_condition_flag_variable) {\n",
+    "                                                                }\n",
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+    size_t size = (argc > 1 ? atol(argv[1]) : 16) << 20;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    select_scanner(argc > 3 ? argv[3] : NULL);
+
+    char *input = calloc(1, size + 32);
+    size_t len = 0;
+    for (int i = 0;; i = (i + 1) % (sizeof(sample) / sizeof(*sample))) {
+        size_t n = strlen(sample[i]);
+        if (len + n > size)
+            break;
+        memcpy(input + len, sample[i], n);
+        len += n;
+    }
+    input[len] = '\0';
+
+    double best = 0;
+    long tokens = 0;
+    for (int i = 0; i < rounds; i++) {
+        arena_reset(&token_arena);
+        double start = now();
+        tokens = 0;
+        for (Token *tok = tokenize("bench", input); tok; tok = tok->next)
+            tokens++;
+        double elapsed = now() - start;
+        if (best == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    printf("tokenize (%s): %.1f MB, %ld tokens, %.3f s, %.1f MB/s\n",
+           scanner_name(), len / 1e6, tokens, best, len / 1e6 / best);
+    return 0;
+}
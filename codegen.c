@@ -1,239 +1,611 @@
 #include "9cc.h"
 
-int label_index = 0;
+//
+// IRをx86-64の命令列にする
+// 仮想レジスタはallocate_registersで決めたレジスタかスタックの場所に読み替える
+// 両方のオペランドがメモリになるときはr11を経由する
+//
 
-static void gen_expr(Node *node);
+static Operand none = {OPD_NONE};
 
-static void gen_lval(Node *node) {
-    if (node->kind != ND_LVAR)
-        error("代入の左辺値が変数ではありません");
+// 関数を呼ばない関数は、rspより下の128バイト(レッドゾーン)に変数を置ける
+#define RED_ZONE 128
 
-    // ベースポインタの値をraxに移す
-    // 変数のアドレスをrax-offsetで計算
-    // スタックトップに変数のアドレスをプッシュ
-    printf("    # push an address of lvar\n");
-    printf("    mov rax, rbp\n");
-    printf("    sub rax, %d\n", node->offset);
-    printf("    push rax\n");
+// ジャンプ命令で飛ばれる、ラベルが要るブロック
+static _Thread_local bool *is_target;
+
+// ブロックのラベルの番号は関数をまたいで通し番号にする
+static _Thread_local int label_base;
+
+// 偽ならrbpのフレームを作らず、変数をレッドゾーンに置く
+static _Thread_local bool use_rbp;
+
+static void emit0(Opcode op) {
+    emit(op, none, none);
+}
+
+static void emit1(Opcode op, Operand dst) {
+    emit(op, dst, none);
+}
+
+static Operand loc(int v) {
+    return vreg_loc[v];
+}
+
+static Operand block_label(int b) {
+    return label_op(".L", label_base + b);
+}
+
+static bool same(Operand a, Operand b) {
+    return a.kind == b.kind && a.reg == b.reg && (a.kind != OPD_MEM || a.val == b.val);
+}
+
+static bool is_imm32(Operand op) {
+    return op.kind == OPD_IMM && op.val == (int)op.val;
+}
+
+static void mov(Operand dst, Operand src) {
+    if (same(dst, src))
+        return;
+    // メモリ同士と、メモリへの32bitに収まらない即値はr11を経由する
+    if (dst.kind == OPD_MEM && (src.kind == OPD_MEM || (src.kind == OPD_IMM && !is_imm32(src)))) {
+        emit(I_MOV, reg_op(R11), src);
+        src = reg_op(R11);
+    }
+    emit(I_MOV, dst, src);
+}
+
+// 結果を作るレジスタ。結果の置き場所がメモリならr11で作ってから書く
+static Operand work_reg(int v) {
+    Operand op = loc(v);
+    return op.kind == OPD_REG ? op : reg_op(R11);
+}
+
+// 2^k, 3*2^k, 5*2^k, 9*2^kを掛けるのはleaとshlにする
+static bool gen_mul_const(IR *ir, Operand a, long c) {
+    if (c < 2)
+        return false;
+    int k = __builtin_ctzl(c);
+    c >>= k;
+    if (c != 1 && c != 3 && c != 5 && c != 9)
+        return false;
+
+    Operand w = work_reg(ir->dst);
+    if (c == 1) {
+        mov(w, a);
+    } else {
+        // lea w, [a+a*(c-1)]
+        if (a.kind != OPD_REG) {
+            mov(w, a);
+            a = w;
+        }
+        emit(I_LEA, w, index_op(a.reg, a.reg, c - 1, 0));
+    }
+    if (k)
+        emit(I_SHL, w, imm_op(k));
+    mov(loc(ir->dst), w);
+    return true;
 }
 
-static void gen_args(int num_args, NDList *args) {
-        printf("    # copy args to registors\n");
+// dst = a <op> b
+static void gen_arith(Opcode op, IR *ir) {
+    Operand a = loc(ir->a);
+    Operand b = loc(ir->b);
+    Operand w = work_reg(ir->dst);
 
-        for (int i = 0; i < num_args; i++) {
-            gen_expr(args->node);
-            args = args->next;
+    // 足し算と掛け算は即値を右に回す
+    if ((op == I_ADD || op == I_IMUL) && a.kind == OPD_IMM) {
+        b = a;
+        a = loc(ir->b);
+    }
+
+    if (op == I_IMUL && b.kind == OPD_IMM && gen_mul_const(ir, a, b.val))
+        return;
+
+    // 別のレジスタに定数を足した値はleaで1命令で作る
+    if ((op == I_ADD || op == I_SUB) && a.kind == OPD_REG && b.kind == OPD_IMM && !same(w, a)) {
+        long d = op == I_ADD ? b.val : -b.val;
+        if (d == (int)d) {
+            emit(I_LEA, w, mem_op(a.reg, d));
+            mov(loc(ir->dst), w);
+            return;
         }
+    }
+
+    // aを移す前にbを壊さないようにする
+    if (same(w, b) && !same(w, a)) {
+        if (op == I_ADD || op == I_IMUL) {
+            b = a;
+            a = w;
+        } else {
+            w = reg_op(R11);
+        }
+    }
+    mov(w, a);
+    emit(op, w, b);
+    mov(loc(ir->dst), w);
+}
 
+// 2の冪で割る。負の数は0の方へ丸めるように、割る前に2^k-1を足す
+static void gen_div_pow2(IR *ir, long d, int k) {
+    mov(reg_op(RAX), loc(ir->a));
+    emit(I_MOV, reg_op(RDX), reg_op(RAX));
+    if (k > 1)
+        emit(I_SAR, reg_op(RDX), imm_op(63));
+    emit(I_SHR, reg_op(RDX), imm_op(64 - k)); // 負なら2^k-1、そうでなければ0
+    emit(I_ADD, reg_op(RAX), reg_op(RDX));
+    emit(I_SAR, reg_op(RAX), imm_op(k));
+    if (d < 0)
+        emit1(I_NEG, reg_op(RAX));
+    mov(loc(ir->dst), reg_op(RAX));
+}
 
-        if (num_args >= 6)
-            printf("    pop r9\n");
-        if (num_args >= 5)
-            printf("    pop r8\n");
-        if (num_args >= 4)
-            printf("    pop rcx\n");
-        if (num_args >= 3)
-            printf("    pop rdx\n");
-        if (num_args >= 2)
-            printf("    pop rsi\n");
-        if (num_args >= 1)
-            printf("    pop rdi\n");
-
-        return;
-}
-
-void gen_stmt(Node *node) {
-    int current_label_index;
-
-    switch (node->kind) {
-    case ND_EXPR_STMT:
-        gen_expr(node->lhs);
-        // 式の評価結果としてスタックに一つの値が残っている
-        // はずなので、スタックが溢れないようにポップしておく
-        printf("    pop rax\n");
-        return;
-    case ND_RETURN:
-        printf("    # start return statement\n");
-        gen_expr(node->lhs);
-        printf("    pop rax\n");
-        printf("    mov rsp, rbp\n");
-        printf("    pop rbp\n");
-        // retはスタックをポップしてそのアドレスに飛ぶ
-        // この時点でスタックトップは実行中の関数のリターンアドレス
-        printf("    ret\n");
-        return;
-    case ND_IF:
-        current_label_index = label_index++;
-        printf("    # start if statement\n");
-        printf("    # evaluate conditional expr\n");
-        gen_expr(node->cond);
-        printf("    pop rax\n");
-        printf("    cmp rax, 0\n");
-        printf("    je .Lend%d\n", current_label_index);
-        printf("    # true case%d\n", current_label_index);
-        gen_stmt(node->lhs);
-        printf(".Lend%d:\n", current_label_index);
-        return;
-    case ND_IF_ELSE:
-        current_label_index = label_index++;
-        printf("    # start if statement\n");
-        printf("    # evaluate condition expr\n");
-        gen_expr(node->cond);
-        printf("    pop rax\n");
-        printf("    cmp rax, 0\n");
-        printf("    je .Lelse%d\n", current_label_index);
-        printf("    # true case%d\n", current_label_index);
-        gen_stmt(node->lhs);
-        printf("    jmp .Lend%d\n", current_label_index);
-        printf(".Lelse%d:\n", current_label_index);
-        printf("    # else case%d\n", current_label_index);
-        gen_stmt(node->els);
-        printf(".Lend%d:\n", current_label_index);
-        return;
-    case ND_WHILE:
-        current_label_index = label_index++;
-        printf("    # start while statement\n");
-        printf("    # evaluate condition expr\n");
-        printf(".Lbegin%d:\n", current_label_index);
-        gen_expr(node->cond);
-        printf("    pop rax\n");
-        printf("    cmp rax, 0\n");
-        printf("    je .Lend%d\n", current_label_index);
-        gen_stmt(node->lhs);
-        printf("    jmp .Lbegin%d\n", current_label_index);
-        printf(".Lend%d:\n", current_label_index);
-        return;
-    case ND_FOR:
-        current_label_index = label_index++;
-        printf("    # start for statement\n");
-        if (node->init) {
-            gen_expr(node->init);
-            printf("    pop rax\n");
+// x / d = (x * m) >> (64 + s) となるmとsを求める (Hacker's Delight 10-1)
+static void magic(long d, long *m, int *s) {
+    unsigned long two63 = 1UL << 63;
+    unsigned long ad = d < 0 ? -(unsigned long)d : d;
+    unsigned long t = two63 + ((unsigned long)d >> 63);
+    unsigned long anc = t - 1 - t % ad;
+    unsigned long q1 = two63 / anc, r1 = two63 - q1 * anc;
+    unsigned long q2 = two63 / ad, r2 = two63 - q2 * ad;
+    unsigned long delta;
+    int p = 63;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
         }
-        printf(".Lbegin%d:\n", current_label_index);
-        if (node->cond) {
-            gen_expr(node->cond);
-            printf("    pop rax\n");
-            printf("    cmp rax, 0\n");
-            printf("    je .Lend%d\n", current_label_index);
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
         }
-        gen_stmt(node->lhs);
-        if (node->inc) {
-            gen_expr(node->inc);
-            printf("    pop rax\n");
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    *m = d < 0 ? -(long)(q2 + 1) : (long)(q2 + 1);
+    *s = p - 64;
+}
+
+// 定数での割り算を、上位64bitを取る掛け算とシフトにする
+static void gen_div_magic(IR *ir, long d) {
+    long m;
+    int s;
+    magic(d, &m, &s);
+
+    Operand x = loc(ir->a);
+    if (x.kind == OPD_IMM) {
+        mov(reg_op(R11), x);
+        x = reg_op(R11);
+    }
+    emit(I_MOV, reg_op(RAX), imm_op(m));
+    emit1(I_IMUL1, x); // rdx = (x * m) >> 64
+    if (d > 0 && m < 0)
+        emit(I_ADD, reg_op(RDX), x);
+    else if (d < 0 && m > 0)
+        emit(I_SUB, reg_op(RDX), x);
+    if (s)
+        emit(I_SAR, reg_op(RDX), imm_op(s));
+    // 商が負なら1を足して0の方へ丸める
+    emit(I_MOV, reg_op(RAX), reg_op(RDX));
+    emit(I_SHR, reg_op(RAX), imm_op(63));
+    emit(I_ADD, reg_op(RDX), reg_op(RAX));
+    mov(loc(ir->dst), reg_op(RDX));
+}
+
+static void gen_div(IR *ir) {
+    Operand b = loc(ir->b);
+    if (b.kind == OPD_IMM) {
+        // 0と-1で割るとidivは例外になるので、その振る舞いを残す
+        // LONG_MINは絶対値が64bitに収まらないのでidivのままにする
+        long d = b.val;
+        // 1で割るのはそのまま移すだけ。2^0にするとshrの回数が64になって0とみなされる
+        if (d == 1) {
+            mov(loc(ir->dst), loc(ir->a));
+            return;
         }
-        printf("    jmp .Lbegin%d\n", current_label_index);
-        printf(".Lend%d:\n", current_label_index);
-        return;
-    case ND_BLOCK:
-        NDList *cur;
-        cur = node->block;
-        while (cur->node) {
-            gen_stmt(cur->node);
-            cur = cur->next;
+        if (d != 0 && d != -1 && d != LONG_MIN) {
+            long ad = d < 0 ? -d : d;
+            if ((ad & (ad - 1)) == 0)
+                gen_div_pow2(ir, d, __builtin_ctzl(ad));
+            else
+                gen_div_magic(ir, d);
+            return;
         }
+        // idivは即値を取れない
+        mov(reg_op(R11), b);
+        b = reg_op(R11);
+    }
+    mov(reg_op(RAX), loc(ir->a));
+    emit0(I_CQO); // raxを128bitにセット
+    emit1(I_IDIV, b); // rax / b
+    mov(loc(ir->dst), reg_op(RAX));
+}
+
+// cmp a, bを作って、比較が真になる条件のjccを返す
+static Opcode gen_cmp(IR *ir) {
+    static Opcode jcc[] = {[IR_EQ] = I_JE, [IR_NE] = I_JNE, [IR_LT] = I_JL, [IR_LE] = I_JLE};
+    static Opcode swapped[] = {[I_JE] = I_JE, [I_JNE] = I_JNE, [I_JL] = I_JG, [I_JLE] = I_JGE};
+
+    Operand a = loc(ir->a);
+    Operand b = loc(ir->b);
+    Opcode cc = jcc[ir->op];
+    // 即値は右にしか置けないので、左右を入れ替えて条件を逆向きにする
+    if (a.kind == OPD_IMM && b.kind != OPD_IMM) {
+        Operand t = a;
+        a = b;
+        b = t;
+        cc = swapped[cc];
+    }
+    // 両方がメモリならaをr11に移す
+    if (a.kind == OPD_IMM || (a.kind == OPD_MEM && b.kind == OPD_MEM)) {
+        mov(reg_op(R11), a);
+        a = reg_op(R11);
+    }
+    emit(I_CMP, a, b);
+    return cc;
+}
+
+static void gen_compare(IR *ir) {
+    static Opcode setcc[] = {[I_JE] = I_SETE, [I_JNE] = I_SETNE, [I_JL] = I_SETL,
+                             [I_JLE] = I_SETLE, [I_JG] = I_SETG, [I_JGE] = I_SETGE};
+
+    emit1(setcc[gen_cmp(ir)], reg_op(RAX));
+    Operand w = work_reg(ir->dst);
+    emit(I_MOVZB, w, reg_op(RAX));
+    mov(loc(ir->dst), w);
+}
+
+// 比較の結果がすぐ後の分岐でしか使われないなら、真偽値を作らずにjccで分岐する
+static bool is_fused(IR *ir) {
+    switch (ir->op) {
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+        // 比較の直後は同じブロックの命令なので、次の命令がそのブロックの終端
+        return ir[1].op == IR_BR && ir[1].a == ir->dst && vreg_global[ir->dst] < 0;
+    default:
+        return false;
+    }
+}
+
+// 条件が成り立てばthenに、成り立たなければelsに飛ぶ。invは逆の条件のjcc
+static void gen_branch(Opcode jcc, Opcode inv, IR *ir, int next) {
+    if (ir->then == next) {
+        if (ir->els != next)
+            emit1(inv, block_label(ir->els));
+        return;
+    }
+    if (ir->els == next) {
+        emit1(jcc, block_label(ir->then));
         return;
     }
+    emit1(inv, block_label(ir->els));
+    emit1(I_JMP, block_label(ir->then));
+}
+
+static void gen_br(IR *ir, int next) {
+    static Opcode inv[] = {[I_JE] = I_JNE, [I_JNE] = I_JE, [I_JL] = I_JGE,
+                           [I_JLE] = I_JG, [I_JG] = I_JLE, [I_JGE] = I_JL};
+
+    IR *cmp = ir - 1;
+    if (ir > irs && is_fused(cmp)) {
+        Opcode cc = gen_cmp(cmp);
+        gen_branch(cc, inv[cc], ir, next);
+        return;
+    }
+    emit(I_CMP, loc(ir->a), imm_op(0));
+    gen_branch(I_JNE, I_JE, ir, next);
+}
+
+// i番目以外のまだ移していない引数がregを読むか
+static bool reads_reg(Operand *src, bool *done, int n, int i, Reg reg) {
+    for (int j = 0; j < n; j++)
+        if (j != i && !done[j] && src[j].kind == OPD_REG && src[j].reg == reg)
+            return true;
+    return false;
+}
+
+// 7個目以降の引数は後ろから積んで、7個目がスタックトップに来るようにする
+// 6個目までは引数のレジスタに直接移す。レジスタにある値は、移し先を他の引数が
+// まだ読むなら後回しにし、互いに待って回らなくなったらr11に逃がして断ち切る
+// 定数と変数はどのレジスタも壊さないので、最後にそのまま読み込む
+static void gen_args(IR *ir) {
+    static Reg arg_reg[] = {RDI, RSI, RDX, RCX, R8, R9};
+
+    if (ir->num_args > 0)
+        emit_comment("copy args to registors");
+    for (int i = ir->num_args - 1; i >= 6; i--)
+        emit1(I_PUSH, loc(ir_use(ir, i)));
+
+    int n = ir->num_args < 6 ? ir->num_args : 6;
+    Operand src[6];
+    bool done[6];
+    for (int i = 0; i < n; i++) {
+        src[i] = loc(ir_use(ir, i));
+        done[i] = src[i].kind != OPD_REG;
+    }
+    for (;;) {
+        bool progress = false;
+        int pending = -1;
+        for (int i = 0; i < n; i++) {
+            if (done[i])
+                continue;
+            if (reads_reg(src, done, n, i, arg_reg[i])) {
+                pending = i;
+                continue;
+            }
+            mov(reg_op(arg_reg[i]), src[i]);
+            done[i] = progress = true;
+        }
+        if (pending < 0)
+            break;
+        if (progress)
+            continue;
+
+        // 循環している。移し先の今の値をr11に逃がせば、そこへは書ける
+        Reg r = arg_reg[pending];
+        emit(I_MOV, reg_op(R11), reg_op(r));
+        for (int j = 0; j < n; j++)
+            if (!done[j] && src[j].kind == OPD_REG && src[j].reg == r)
+                src[j] = reg_op(R11);
+    }
+    for (int i = 0; i < n; i++)
+        if (src[i].kind != OPD_REG)
+            mov(reg_op(arg_reg[i]), src[i]);
+
+    emit(I_MOV, reg_op(RAX), imm_op(ir->num_args));
+}
+
+// 呼び出しの結果をそのまま返すなら、callとretの代わりにフレームを畳んでjmpする
+// スタックに積む引数は呼び出し元の領域に収まるとは限らないので、レジスタで渡せるものだけ
+static bool is_tail_call(IR *ir) {
+    return ir->op == IR_CALL && ir[1].op == IR_RET && ir[1].a == ir->dst && ir->num_args <= 6;
+}
+
+static void gen_call(IR *ir) {
+    emit_comment("call function");
+    // 呼び出しをまたいで生きているレジスタは壊れるので退避する
+    for (int r = 0; r < 16; r++)
+        if (ir->saved & 1u << r)
+            emit1(I_PUSH, reg_op(r));
+
+    // フレームは16バイト単位なので、ここまでに積んだ分だけ見ればrspを揃えられる
+    int stack_args = ir->num_args > 6 ? ir->num_args - 6 : 0;
+    int pad = (__builtin_popcount(ir->saved) + stack_args) % 2 ? 8 : 0;
+    if (pad)
+        emit(I_SUB, reg_op(RSP), imm_op(pad));
+
+    gen_args(ir);
+    emit1(I_CALL, sym_op(ir->name, ir->len));
+    // レジスタに入らなかった引数と詰め物を捨てる
+    if (stack_args || pad)
+        emit(I_ADD, reg_op(RSP), imm_op(8 * stack_args + pad));
+
+    for (int r = 15; r >= 0; r--)
+        if (ir->saved & 1u << r)
+            emit1(I_POP, reg_op(r));
+    mov(loc(ir->dst), reg_op(RAX)); // 返り値
+}
+
+// フレームを畳んで、変数を置いたレジスタを戻し、rspを関数に入ったときの位置に戻す
+static void gen_leave() {
+    int saved = 8 * __builtin_popcount(saved_regs);
+    if (use_rbp) {
+        if (saved)
+            emit(I_LEA, reg_op(RSP), mem_op(RBP, -saved));
+        else
+            emit(I_MOV, reg_op(RSP), reg_op(RBP));
+    }
+    for (int r = 15; r >= 0; r--)
+        if (saved_regs & 1u << r)
+            emit1(I_POP, reg_op(r));
+    if (use_rbp)
+        emit1(I_POP, reg_op(RBP));
+}
+
+// 飛んだ先の関数は、この関数の呼び出し元に直接戻る
+static void gen_tail_call(IR *ir) {
+    emit_comment("tail call");
+    gen_args(ir);
+    gen_leave();
+    emit1(I_JMP, sym_op(ir->name, ir->len));
+}
+
+static void gen_epilogue() {
+    emit_comment("epilogue");
+    gen_leave();
+    // retはスタックをポップしてそのアドレスに飛ぶ
+    // この時点でスタックトップは実行中の関数のリターンアドレス
+    emit0(I_RET);
+}
+
+// nextは配置で次に来るブロック。そこへのジャンプは省く
+static void gen_insn(IR *ir, int next) {
+    switch (ir->op) {
+    case IR_IMM:
+        if (vreg_tile[ir->dst].kind == OPD_NONE)
+            mov(loc(ir->dst), imm_op(ir->imm));
+        return;
+    case IR_MOV:
+        mov(loc(ir->dst), loc(ir->a));
+        return;
+    case IR_ADD:
+        gen_arith(I_ADD, ir);
+        return;
+    case IR_SUB:
+        gen_arith(I_SUB, ir);
+        return;
+    case IR_MUL:
+        gen_arith(I_IMUL, ir);
+        return;
+    case IR_DIV:
+        gen_div(ir);
+        return;
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+        if (!is_fused(ir))
+            gen_compare(ir);
+        return;
+    case IR_NEG: {
+        Operand w = work_reg(ir->dst);
+        mov(w, loc(ir->a));
+        emit1(I_NEG, w);
+        mov(loc(ir->dst), w);
+        return;
+    }
+    case IR_LOAD:
+        if (vreg_tile[ir->dst].kind == OPD_NONE)
+            mov(loc(ir->dst), var_loc(ir->var));
+        return;
+    case IR_STORE:
+        mov(var_loc(ir->var), loc(ir->a));
+        return;
+    case IR_CALL:
+        if (is_tail_call(ir))
+            gen_tail_call(ir);
+        else
+            gen_call(ir);
+        return;
+    case IR_JMP:
+        if (ir->then != next)
+            emit1(I_JMP, block_label(ir->then));
+        return;
+    case IR_BR:
+        gen_br(ir, next);
+        return;
+    case IR_RET:
+        if (ir > irs && is_tail_call(ir - 1))
+            return;
+        mov(reg_op(RAX), loc(ir->a));
+        gen_epilogue();
+        return;
+    }
+}
+
+// layout[i]の後ろで最初の空でないブロック。到達しないブロックは空になっている
+static int next_block(int i) {
+    for (i++; i < num_layout; i++)
+        if (blocks[layout[i]].start != blocks[layout[i]].end)
+            return layout[i];
+    return -1;
+}
+
+// 実際にジャンプ命令で飛ばれるブロックに印を付ける
+static void mark_targets() {
+    is_target = realloc(is_target, sizeof(bool) * (num_blocks + 1));
+    memset(is_target, 0, sizeof(bool) * (num_blocks + 1));
+    for (int i = 0; i < num_layout; i++) {
+        Block *b = &blocks[layout[i]];
+        if (b->start == b->end)
+            continue;
+        IR *last = &irs[b->end - 1];
+        int next = next_block(i);
+        if ((last->op == IR_JMP || last->op == IR_BR) && last->then != next)
+            is_target[last->then] = true;
+        if (last->op == IR_BR && last->els != next)
+            is_target[last->els] = true;
+    }
+}
+
+// レジスタで渡された引数と、スタックに積まれた7個目以降の引数を変数の場所に移す
+static void gen_params(Function *fn) {
+    static Reg arg_reg[] = {RDI, RSI, RDX, RCX, R8, R9};
+
+    int saved = 8 * __builtin_popcount(saved_regs);
+    for (int i = 0; i < fn->num_params; i++) {
+        Operand var = var_loc(fn->params[i]);
+        if (i < 6)
+            mov(var, reg_op(arg_reg[i]));
+        else if (use_rbp)
+            mov(var, mem_op(RBP, 16 + 8 * (i - 6))); // 退避したrbpとリターンアドレスの上
+        else
+            mov(var, mem_op(RSP, saved + 8 + 8 * (i - 6)));
+    }
+}
+
+// IRから関数の命令列をinsnsの後ろに足す
+// 最初の関数で命令列を空にする
+void codegen(Function *fn) {
+    if (fn == functions) {
+        num_insns = 0;
+        label_base = 0;
+    }
+    locals = fn->locals;
+    promote_vars();
+    select_operands();
+    allocate_registers();
+    mark_targets();
+
+    // 末尾呼び出しは引数をレジスタに移して飛ぶだけなので、スタックを使わない
+    bool leaf = true;
+    for (int j = 0; j < num_irs; j++)
+        if (irs[j].op == IR_CALL && !is_tail_call(&irs[j]))
+            leaf = false;
+    int saved = 8 * __builtin_popcount(saved_regs);
+    int size = frame_size + spill_size;
+    use_rbp = !leaf || size - saved > RED_ZONE;
+    int start = num_insns;
+
+    emit1(I_GLOBL, sym_op(fn->name, fn->len));
+    emit1(I_LABEL, sym_op(fn->name, fn->len));
+
+    // プロローグ
+    // 変数を置くレジスタを退避して、その下に変数と追い出した値の領域を確保する
+    // 合わせて16の倍数にしておけば、呼び出しのときにrspの揃い方がコンパイル時にわかる
+    emit_comment("prologue");
+    if (use_rbp) {
+        emit1(I_PUSH, reg_op(RBP));
+        emit(I_MOV, reg_op(RBP), reg_op(RSP));
+    }
+    for (int r = 0; r < 16; r++)
+        if (saved_regs & 1u << r)
+            emit1(I_PUSH, reg_op(r));
+    if (use_rbp) {
+        size = ((size + 15) & ~15) - saved;
+        if (size)
+            emit(I_SUB, reg_op(RSP), imm_op(size));
+    }
+    gen_params(fn);
+
+    for (int i = 0; i < num_layout; i++) {
+        int b = layout[i];
+        if (blocks[b].start == blocks[b].end)
+            continue;
+        if (is_target[b]) {
+            if (blocks[b].loop)
+                emit1(I_ALIGN, imm_op(4));
+            emit1(I_LABEL, block_label(b));
+        }
+        int next = next_block(i);
+        for (int j = blocks[b].start; j < blocks[b].end; j++)
+            gen_insn(&irs[j], next);
+    }
+
+    // rbpを使わないなら、変数と追い出した値の[rbp-N]を
+    // レッドゾーンの[rsp-N]に読み替える。rspは退避したレジスタの分だけ下にある
+    if (!use_rbp) {
+        for (int i = start; i < num_insns; i++) {
+            Operand *ops[] = {&insns[i].dst, &insns[i].src};
+            for (int k = 0; k < 2; k++) {
+                if (ops[k]->kind == OPD_MEM && ops[k]->reg == RBP) {
+                    ops[k]->reg = RSP;
+                    ops[k]->val += saved;
+                }
+            }
+        }
+    }
+    label_base += num_blocks;
 }
 
-static void gen_expr(Node *node) {
-    switch (node->kind) {
-    // 数値の場合はここで処理。
-    // LHSとRHSは存在しないのでreturn。
-    case ND_NUM:
-        printf("    push %d\n", node->val);
-        return;
-    case ND_LVAR:
-        gen_lval(node);
-        // スタックトップに変数のアドレスの値をプッシュ
-        // 変数の値を展開してる
-        printf("    # push a value of lvar\n");
-        printf("    pop rax\n");
-        printf("    mov rax, [rax]\n");
-        printf("    push rax\n");
-        return;
-    case ND_ASSIGN:
-        printf("    # start assingnment\n");
-        // 左辺の変数のアドレスをプッシュ
-        // 左辺がLVARでなかった場合のエラー出力もここで
-        gen_lval(node->lhs);
-        // 右辺を評価
-        gen_expr(node->rhs);
-
-        printf("    pop rdi\n");
-        printf("    pop rax\n");
-        // 左辺の変数のアドレスが示す場所に右辺の結果を移動
-        printf("    mov [rax], rdi\n");
-        printf("    push rdi\n");
-        return;
-    case ND_CALL:
-        printf("    # call function\n");
-        if (node->num_args > 0)
-            gen_args(node->num_args, node->args);
-
-        // set RSP to 16x number
-        // printf("    mov rax, rsp\n"); // rax = rsp
-        // printf("    and rax, 8\n");   // rax = 8 & rax
-        // printf("    sub rsp, rax\n"); // rsp = rsp - 8 or rps
-        // printf("    push rax\n");     // push offset for rsp
-        printf("    mov rax, rsp\n");
-        printf("    and rsp, -16\n");
-        printf("    push rax\n");
-        printf("    push rax\n");
-
-        printf("    mov rax, %d\n", node->num_args);
-        printf("    call %.*s\n", node->len, node->str);
-        // printf("    pop rdi\n");     // pop the offset
-        // printf("    add rsp, rdi\n");// add the offset to rsp
-        printf("    pop rsp\n");
-
-        printf("    push rax\n");    // push return value
-
-        return;
-    }
-
-    // 以下exprの演算処理の複数項のため再帰している
-    gen_expr(node->lhs);
-    gen_expr(node->rhs);
-
-    printf("    pop rdi\n"); // rhsの結果をpop
-    printf("    pop rax\n"); // lhsの結果をpop
-
-    switch (node->kind) {
-    case ND_ADD:
-        printf("    add rax, rdi\n");
-        break;
-    case ND_SUB:
-        printf("    sub rax, rdi\n");
-        break;
-    case ND_MUL:
-        printf("    imul rax, rdi\n");
-        break;
-    case ND_DIV:
-        printf("    cqo\n"); // raxを128bitにセット
-        printf("    idiv rdi\n"); // rax / rdi
-        break;
-    case ND_EQ:
-        printf("    cmp rax, rdi\n");
-        printf("    sete al\n");
-        printf("    movzb rax, al\n");
-        break;
-    case ND_NE:
-        printf("    cmp rax, rdi\n");
-        printf("    setne al\n");
-        printf("    movzb rax, al\n");
-        break;
-    case ND_LT:
-        printf("    cmp rax, rdi\n");
-        printf("    setl al\n");
-        printf("    movzb rax, al\n");
-        break;
-    case ND_LE:
-        printf("    cmp rax, rdi\n");
-        printf("    setle al\n");
-        printf("    movzb rax, al\n");
-        break;
-    }
-
-    printf("    push rax\n");
+// スレッドの作業領域を解放する
+void free_codegen() {
+    free(is_target);
+    is_target = NULL;
 }
@@ -0,0 +1,183 @@
+#include "9cc.h"
+#include <elf.h>
+
+//
+// encodeした機械語を再配置可能なELF64オブジェクトとして書き出す
+//
+// セクションは .text, .rela.text, .symtab, .strtab, .shstrtab と、
+// スタックを実行可能にしないための空の .note.GNU-stack
+//
+
+enum { SEC_NULL, SEC_TEXT, SEC_RELA, SEC_SYMTAB, SEC_STRTAB, SEC_SHSTRTAB, SEC_NOTE, NUM_SECTIONS };
+
+static char shstrtab[] =
+    "\0.text\0.rela.text\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack";
+
+static _Thread_local char *buf;
+static _Thread_local size_t len;
+static _Thread_local size_t capacity;
+
+static void reserve(size_t n) {
+    if (len + n <= capacity)
+        return;
+    while (len + n > capacity)
+        capacity = capacity ? capacity * 2 : 1 << 16;
+    buf = realloc(buf, capacity);
+    if (buf == NULL)
+        error("メモリを確保できません");
+}
+
+static size_t out_mem(void *p, size_t n) {
+    reserve(n);
+    memcpy(buf + len, p, n);
+    len += n;
+    return len - n;
+}
+
+static void align_to(size_t align) {
+    while (len % align)
+        out_mem("", 1);
+}
+
+static int shstr_index(char *name) {
+    for (int i = 1; i < sizeof(shstrtab); i += strlen(shstrtab + i) + 1)
+        if (!strcmp(shstrtab + i, name))
+            return i;
+    return 0;
+}
+
+// 未定義のシンボルは他のオブジェクトにあるのでグローバルにする
+static bool is_local(Symbol *sym) {
+    return !sym->global && sym->offset >= 0;
+}
+
+// ローカルなシンボルを先に、グローバルなものを後に並べたときの番号
+static _Thread_local int *sym_index;
+
+void write_elf() {
+    len = 0;
+    Elf64_Shdr sh[NUM_SECTIONS] = {0};
+
+    Elf64_Ehdr eh = {0};
+    out_mem(&eh, sizeof(eh));
+
+    // .text
+    align_to(16);
+    sh[SEC_TEXT].sh_offset = out_mem(text, text_len);
+    sh[SEC_TEXT].sh_size = text_len;
+
+    // .strtab と .symtab の番号付け
+    sym_index = realloc(sym_index, sizeof(int) * (num_symbols + 1));
+    if (sym_index == NULL)
+        error("メモリを確保できません");
+    int next = 1;
+    for (int i = 0; i < num_symbols; i++)
+        if (is_local(&symbols[i]))
+            sym_index[i] = next++;
+    int first_global = next;
+    for (int i = 0; i < num_symbols; i++)
+        if (!is_local(&symbols[i]))
+            sym_index[i] = next++;
+
+    Elf64_Sym *syms = calloc(next, sizeof(Elf64_Sym));
+    size_t strtab_start = len;
+    out_mem("", 1);
+    for (int i = 0; i < num_symbols; i++) {
+        Symbol *sym = &symbols[i];
+        Elf64_Sym *es = &syms[sym_index[i]];
+        es->st_name = len - strtab_start;
+        out_mem(sym->name, sym->len);
+        out_mem("", 1);
+
+        bool defined = sym->offset >= 0;
+        int bind = is_local(sym) ? STB_LOCAL : STB_GLOBAL;
+        es->st_info = ELF64_ST_INFO(bind, defined ? STT_FUNC : STT_NOTYPE);
+        es->st_shndx = defined ? SEC_TEXT : SHN_UNDEF;
+        es->st_value = defined ? sym->offset : 0;
+    }
+    sh[SEC_STRTAB].sh_offset = strtab_start;
+    sh[SEC_STRTAB].sh_size = len - strtab_start;
+
+    align_to(8);
+    sh[SEC_SYMTAB].sh_offset = out_mem(syms, sizeof(Elf64_Sym) * next);
+    sh[SEC_SYMTAB].sh_size = sizeof(Elf64_Sym) * next;
+    free(syms);
+
+    // .rela.text
+    // call命令のrel32は次の命令の位置からの相対なので-4を足す
+    sh[SEC_RELA].sh_offset = len;
+    for (int i = 0; i < num_relocs; i++) {
+        Elf64_Rela rela = {0};
+        rela.r_offset = relocs[i].offset;
+        rela.r_info = ELF64_R_INFO(sym_index[relocs[i].symbol], R_X86_64_PLT32);
+        rela.r_addend = -4;
+        out_mem(&rela, sizeof(rela));
+    }
+    sh[SEC_RELA].sh_size = len - sh[SEC_RELA].sh_offset;
+
+    sh[SEC_SHSTRTAB].sh_offset = out_mem(shstrtab, sizeof(shstrtab));
+    sh[SEC_SHSTRTAB].sh_size = sizeof(shstrtab);
+    sh[SEC_NOTE].sh_offset = len;
+
+    sh[SEC_TEXT].sh_name = shstr_index(".text");
+    sh[SEC_TEXT].sh_type = SHT_PROGBITS;
+    sh[SEC_TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    sh[SEC_TEXT].sh_addralign = 16;
+
+    sh[SEC_RELA].sh_name = shstr_index(".rela.text");
+    sh[SEC_RELA].sh_type = SHT_RELA;
+    sh[SEC_RELA].sh_flags = SHF_INFO_LINK;
+    sh[SEC_RELA].sh_link = SEC_SYMTAB;
+    sh[SEC_RELA].sh_info = SEC_TEXT;
+    sh[SEC_RELA].sh_addralign = 8;
+    sh[SEC_RELA].sh_entsize = sizeof(Elf64_Rela);
+
+    sh[SEC_SYMTAB].sh_name = shstr_index(".symtab");
+    sh[SEC_SYMTAB].sh_type = SHT_SYMTAB;
+    sh[SEC_SYMTAB].sh_link = SEC_STRTAB;
+    sh[SEC_SYMTAB].sh_info = first_global;
+    sh[SEC_SYMTAB].sh_addralign = 8;
+    sh[SEC_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+
+    sh[SEC_STRTAB].sh_name = shstr_index(".strtab");
+    sh[SEC_STRTAB].sh_type = SHT_STRTAB;
+    sh[SEC_STRTAB].sh_addralign = 1;
+
+    sh[SEC_SHSTRTAB].sh_name = shstr_index(".shstrtab");
+    sh[SEC_SHSTRTAB].sh_type = SHT_STRTAB;
+    sh[SEC_SHSTRTAB].sh_addralign = 1;
+
+    sh[SEC_NOTE].sh_name = shstr_index(".note.GNU-stack");
+    sh[SEC_NOTE].sh_type = SHT_PROGBITS;
+    sh[SEC_NOTE].sh_addralign = 1;
+
+    align_to(8);
+    size_t shoff = out_mem(sh, sizeof(sh));
+
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr *)buf;
+    memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+    ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr->e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr->e_type = ET_REL;
+    ehdr->e_machine = EM_X86_64;
+    ehdr->e_version = EV_CURRENT;
+    ehdr->e_shoff = shoff;
+    ehdr->e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr->e_shentsize = sizeof(Elf64_Shdr);
+    ehdr->e_shnum = NUM_SECTIONS;
+    ehdr->e_shstrndx = SEC_SHSTRTAB;
+
+    stats.bytes = len;
+    write_out(buf, len);
+}
+
+// スレッドの作業領域を解放する
+void free_elf() {
+    free(buf);
+    free(sym_index);
+    buf = NULL;
+    sym_index = NULL;
+    len = capacity = 0;
+}
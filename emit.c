@@ -0,0 +1,199 @@
+#include "9cc.h"
+#include <unistd.h>
+
+//
+// 命令列をIntel記法のアセンブリとして書き出す
+// printfは使わず、1つのバッファに組み立てて最後にまとめてwriteする
+//
+
+static _Thread_local char *buf;
+static _Thread_local size_t len;
+static _Thread_local size_t capacity;
+
+static char *reg64[] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+static char *reg8[] = {
+    "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+    "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+};
+
+static char *mnemonic[] = {
+    [I_MOV] = "mov", [I_LEA] = "lea", [I_ADD] = "add", [I_SUB] = "sub",
+    [I_IMUL] = "imul", [I_NEG] = "neg", [I_AND] = "and",
+    [I_SHL] = "shl", [I_SHR] = "shr", [I_SAR] = "sar",
+    [I_CMP] = "cmp", [I_CQO] = "cqo", [I_IDIV] = "idiv", [I_IMUL1] = "imul",
+    [I_SETE] = "sete", [I_SETNE] = "setne", [I_SETL] = "setl", [I_SETLE] = "setle",
+    [I_SETG] = "setg", [I_SETGE] = "setge",
+    [I_MOVZB] = "movzb", [I_PUSH] = "push", [I_POP] = "pop",
+    [I_JMP] = "jmp", [I_JE] = "je", [I_JNE] = "jne", [I_JL] = "jl", [I_JLE] = "jle",
+    [I_JG] = "jg", [I_JGE] = "jge", [I_CALL] = "call", [I_RET] = "ret",
+};
+
+static void reserve(size_t n) {
+    if (len + n <= capacity)
+        return;
+    while (len + n > capacity)
+        capacity = capacity ? capacity * 2 : 1 << 20;
+    buf = realloc(buf, capacity);
+    if (buf == NULL)
+        error("出力バッファを確保できません");
+}
+
+static void out_mem(char *s, size_t n) {
+    reserve(n);
+    memcpy(buf + len, s, n);
+    len += n;
+}
+
+static void out_str(char *s) {
+    out_mem(s, strlen(s));
+}
+
+static void out_char(char c) {
+    reserve(1);
+    buf[len++] = c;
+}
+
+// 符号なし整数を10進で書き出す
+static void out_ulong(unsigned long val) {
+    char tmp[20];
+    int i = sizeof(tmp);
+    do {
+        tmp[--i] = '0' + val % 10;
+        val /= 10;
+    } while (val);
+    out_mem(tmp + i, sizeof(tmp) - i);
+}
+
+static void out_long(long val) {
+    if (val < 0) {
+        out_char('-');
+        out_ulong(-(unsigned long)val);
+        return;
+    }
+    out_ulong(val);
+}
+
+static void out_operand(Operand *op, bool byte) {
+    switch (op->kind) {
+    case OPD_REG:
+        out_str(byte ? reg8[op->reg] : reg64[op->reg]);
+        return;
+    case OPD_IMM:
+        out_long(op->val);
+        return;
+    case OPD_MEM:
+        out_char('[');
+        out_str(reg64[op->reg]);
+        if (op->scale) {
+            out_char('+');
+            out_str(reg64[op->index]);
+            out_char('*');
+            out_long(op->scale);
+        }
+        if (op->val > 0)
+            out_char('+');
+        if (op->val)
+            out_long(op->val);
+        out_char(']');
+        return;
+    case OPD_LABEL:
+        // .Lend3 のように接頭辞と番号をつなげる
+        out_str(op->str);
+        out_long(op->val);
+        return;
+    case OPD_SYM:
+        out_mem(op->str, op->len);
+        return;
+    }
+}
+
+static void out_insn(Insn *insn) {
+    if (insn->op == I_NOP)
+        return;
+
+    stats.lines++;
+    switch (insn->op) {
+    case I_COMMENT:
+        out_str("    # ");
+        out_str(insn->dst.str);
+        out_char('\n');
+        return;
+    case I_LABEL:
+        out_operand(&insn->dst, false);
+        out_mem(":\n", 2);
+        return;
+    case I_GLOBL:
+        out_str(".globl ");
+        out_operand(&insn->dst, false);
+        out_char('\n');
+        return;
+    case I_ALIGN:
+        out_str(".p2align ");
+        out_operand(&insn->dst, false);
+        out_char('\n');
+        return;
+    }
+
+    stats.insns++;
+    out_mem("    ", 4);
+    out_str(mnemonic[insn->op]);
+    if (insn->dst.kind != OPD_NONE) {
+        out_char(' ');
+        // レジスタと組にならないメモリオペランドはサイズを明示する
+        if (insn->dst.kind == OPD_MEM && insn->src.kind != OPD_REG)
+            out_str("qword ptr ");
+        out_operand(&insn->dst, insn->op >= I_SETE && insn->op <= I_SETGE);
+        if (insn->src.kind != OPD_NONE) {
+            out_mem(", ", 2);
+            out_operand(&insn->src, insn->op == I_MOVZB);
+        }
+    }
+    out_char('\n');
+}
+
+// 命令列を標準出力に書き出す
+void print_asm() {
+    len = 0;
+    out_str(".intel_syntax noprefix\n");
+    stats.lines++;
+
+    for (int i = 0; i < num_insns; i++)
+        out_insn(&insns[i]);
+    stats.bytes = len;
+
+    write_out(buf, len);
+}
+
+// 設定されていれば標準出力の代わりにここへ書く
+_Thread_local Sink *sink;
+
+// bufの内容を全て標準出力かsinkに書く
+// sinkに入りきらない分は捨てるが、lenには書こうとした長さを足す
+void write_out(char *buf, size_t len) {
+    if (sink) {
+        if (sink->len < sink->cap) {
+            size_t n = sink->cap - sink->len < len ? sink->cap - sink->len : len;
+            memcpy(sink->buf + sink->len, buf, n);
+        }
+        sink->len += len;
+        return;
+    }
+
+    for (size_t done = 0; done < len;) {
+        ssize_t n = write(STDOUT_FILENO, buf + done, len - done);
+        if (n < 0)
+            error("書き込みに失敗しました");
+        done += n;
+    }
+}
+
+// スレッドの作業領域を解放する
+void free_emit() {
+    free(buf);
+    buf = NULL;
+    len = capacity = 0;
+}
@@ -0,0 +1,475 @@
+#include "9cc.h"
+
+//
+// 命令列をx86-64の機械語に直す
+// アセンブラを通さずにオブジェクトファイルを作ったり、メモリ上で実行したりするのに使う
+//
+// ジャンプはすべてrel32で出すので、ラベルの位置は1回たどれば決まる。
+// ジャンプ先は全部出し終えてから埋める。
+// 外部の関数の呼び出しはrelocsに記録して、リンカかローダに任せる。
+//
+
+_Thread_local unsigned char *text;
+_Thread_local int text_len;
+static _Thread_local int text_cap;
+
+_Thread_local Symbol *symbols;
+_Thread_local int num_symbols;
+static _Thread_local int symbol_cap;
+
+_Thread_local Reloc *relocs;
+_Thread_local int num_relocs;
+static _Thread_local int reloc_cap;
+
+// 名前からsymbolsの添字を引くハッシュ表(-1は空き)
+static _Thread_local int *symbol_table;
+static _Thread_local int symbol_table_cap;
+
+// 各命令の先頭の位置
+static _Thread_local int *insn_offset;
+
+// ローカルラベルへのジャンプで、後から埋めるrel32
+typedef struct {
+    int pos;        // rel32の位置
+    int target;     // 飛び先のI_LABEL命令の添字
+} Fixup;
+
+static _Thread_local Fixup *fixups;
+static _Thread_local int num_fixups;
+static _Thread_local int fixup_cap;
+
+static void *grow(void *p, int *cap, int n, size_t size) {
+    if (n < *cap)
+        return p;
+    *cap = *cap ? *cap * 2 : 1024;
+    p = realloc(p, size * *cap);
+    if (p == NULL)
+        error("メモリを確保できません");
+    return p;
+}
+
+static void out8(int b) {
+    text = grow(text, &text_cap, text_len, 1);
+    text[text_len++] = b;
+}
+
+static void out32(long val) {
+    if (val != (int)val)
+        error("32bitに収まらない即値です: %ld", val);
+    for (int i = 0; i < 4; i++)
+        out8(val >> (i * 8));
+}
+
+static void out64(long val) {
+    for (int i = 0; i < 8; i++)
+        out8(val >> (i * 8));
+}
+
+static bool is_imm8(long val) {
+    return val == (signed char)val;
+}
+
+//
+// シンボル
+//
+
+static int *find_symbol_slot(char *name, int len) {
+    for (unsigned h = hash_name(name, len);; h++) {
+        int *slot = &symbol_table[h & (symbol_table_cap - 1)];
+        if (*slot < 0)
+            return slot;
+        Symbol *sym = &symbols[*slot];
+        if (sym->len == len && !memcmp(sym->name, name, len))
+            return slot;
+    }
+}
+
+static void rehash_symbols() {
+    symbol_table_cap = symbol_table_cap ? symbol_table_cap * 2 : 64;
+    free(symbol_table);
+    symbol_table = malloc(sizeof(int) * symbol_table_cap);
+    if (symbol_table == NULL)
+        error("メモリを確保できません");
+    for (int i = 0; i < symbol_table_cap; i++)
+        symbol_table[i] = -1;
+    for (int i = 0; i < num_symbols; i++)
+        *find_symbol_slot(symbols[i].name, symbols[i].len) = i;
+}
+
+// 名前のシンボルの添字を返す。なければ未定義のシンボルとして足す
+static int intern_symbol(char *name, int len) {
+    if ((num_symbols + 1) * 2 > symbol_table_cap)
+        rehash_symbols();
+    int *slot = find_symbol_slot(name, len);
+    if (*slot >= 0)
+        return *slot;
+
+    symbols = grow(symbols, &symbol_cap, num_symbols, sizeof(Symbol));
+    Symbol *sym = &symbols[num_symbols];
+    sym->name = name;
+    sym->len = len;
+    sym->offset = -1;
+    sym->global = false;
+    *slot = num_symbols;
+    return num_symbols++;
+}
+
+//
+// 命令の符号化
+//
+
+// REXプレフィックス。rは ModRM.reg, bは ModRM.rm かベースレジスタ
+// byte_regsが真ならspl, bpl, sil, dilを表すために空のREXも出す
+static void rex(bool w, int r, Operand *rm, bool byte_regs) {
+    int b = rm && (rm->kind == OPD_REG || rm->kind == OPD_MEM) ? rm->reg : 0;
+    int x = rm && rm->kind == OPD_MEM && rm->scale ? rm->index : 0;
+    int v = 0x40 | w << 3 | (r >> 3) << 2 | (x >> 3) << 1 | (b >> 3);
+    bool low_byte = byte_regs && rm && rm->kind == OPD_REG && rm->reg >= RSP && rm->reg <= RDI;
+    if (v != 0x40 || low_byte)
+        out8(v);
+}
+
+// ModRMと、必要ならSIBと変位
+static void modrm(int r, Operand *rm) {
+    if (rm->kind == OPD_REG) {
+        out8(0xc0 | (r & 7) << 3 | (rm->reg & 7));
+        return;
+    }
+    if (rm->kind != OPD_MEM)
+        error("不正なオペランドです");
+
+    int base = rm->reg & 7;
+    long disp = rm->val;
+    // rbpとr13はmod=0だとRIP相対などの別の意味になるので変位0を明示する
+    int mod = disp == 0 && base != 5 ? 0 : is_imm8(disp) ? 1 : 2;
+    // インデックスがあるときと、rspとr12をベースにするときはSIBが要る
+    if (rm->scale) {
+        static int log2[] = {[1] = 0, [2] = 1, [4] = 2, [8] = 3};
+        out8(mod << 6 | (r & 7) << 3 | 4);
+        out8(log2[rm->scale] << 6 | (rm->index & 7) << 3 | base);
+    } else {
+        out8(mod << 6 | (r & 7) << 3 | base);
+        if (base == 4)
+            out8(0x24);
+    }
+    if (mod == 1)
+        out8(disp);
+    else if (mod == 2)
+        out32(disp);
+}
+
+// op r, r/m の形の命令。opが0xffより大きければ2バイトのオペコード
+static void encode_rm(bool w, int op, int r, Operand *rm) {
+    rex(w, r, rm, false);
+    if (op > 0xff)
+        out8(op >> 8);
+    out8(op & 0xff);
+    modrm(r, rm);
+}
+
+// add, sub, and, cmp
+// digitは即値を取る形(0x81, 0x83)でModRM.regに入れる番号
+static void encode_alu(int digit, Operand *dst, Operand *src) {
+    switch (src->kind) {
+    case OPD_REG:
+        encode_rm(true, digit * 8 + 1, src->reg, dst);
+        return;
+    case OPD_MEM:
+        encode_rm(true, digit * 8 + 3, dst->reg, src);
+        return;
+    case OPD_IMM:
+        if (is_imm8(src->val)) {
+            encode_rm(true, 0x83, digit, dst);
+            out8(src->val);
+        } else {
+            encode_rm(true, 0x81, digit, dst);
+            out32(src->val);
+        }
+        return;
+    }
+    error("不正なオペランドです");
+}
+
+static void encode_mov(Operand *dst, Operand *src) {
+    switch (src->kind) {
+    case OPD_REG:
+        encode_rm(true, 0x89, src->reg, dst);
+        return;
+    case OPD_MEM:
+        encode_rm(true, 0x8b, dst->reg, src);
+        return;
+    case OPD_IMM:
+        if (src->val == (int)src->val) {
+            encode_rm(true, 0xc7, 0, dst);
+            out32(src->val);
+        } else if (dst->kind == OPD_REG) {
+            // movabs
+            rex(true, 0, dst, false);
+            out8(0xb8 + (dst->reg & 7));
+            out64(src->val);
+        } else {
+            error("32bitに収まらない即値です: %ld", src->val);
+        }
+        return;
+    }
+    error("不正なオペランドです");
+}
+
+static void encode_imul(Operand *dst, Operand *src) {
+    if (src->kind != OPD_IMM) {
+        encode_rm(true, 0x0faf, dst->reg, src);
+        return;
+    }
+    // imul dst, dst, imm
+    if (is_imm8(src->val)) {
+        encode_rm(true, 0x6b, dst->reg, dst);
+        out8(src->val);
+    } else {
+        encode_rm(true, 0x69, dst->reg, dst);
+        out32(src->val);
+    }
+}
+
+static void encode_push(Operand *op) {
+    switch (op->kind) {
+    case OPD_REG:
+        rex(false, 0, op, false);
+        out8(0x50 + (op->reg & 7));
+        return;
+    case OPD_MEM:
+        encode_rm(false, 0xff, 6, op);
+        return;
+    case OPD_IMM:
+        if (is_imm8(op->val)) {
+            out8(0x6a);
+            out8(op->val);
+        } else {
+            out8(0x68);
+            out32(op->val);
+        }
+        return;
+    }
+    error("不正なオペランドです");
+}
+
+static void encode_pop(Operand *op) {
+    if (op->kind == OPD_REG) {
+        rex(false, 0, op, false);
+        out8(0x58 + (op->reg & 7));
+        return;
+    }
+    encode_rm(false, 0x8f, 0, op);
+}
+
+// textの長さがalignの倍数になるまでnopで埋める
+// アセンブラと同じく、長いnopを使って命令の数を減らす
+static void pad_nops(int align) {
+    static unsigned char nops[][8] = {
+        {0x90},
+        {0x66, 0x90},
+        {0x0f, 0x1f, 0x00},
+        {0x0f, 0x1f, 0x40, 0x00},
+        {0x0f, 0x1f, 0x44, 0x00, 0x00},
+        {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+        {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+        {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    };
+    int n = (align - text_len % align) % align;
+    while (n > 0) {
+        int k = n < 8 ? n : 8;
+        for (int i = 0; i < k; i++)
+            out8(nops[k - 1][i]);
+        n -= k;
+    }
+}
+
+// 飛び先のrel32は後で埋める
+static void encode_jump(Operand *label) {
+    int target = find_label(label);
+    if (target < 0)
+        error("ラベル%s%ldが定義されていません", label->str, label->val);
+    fixups = grow(fixups, &fixup_cap, num_fixups, sizeof(Fixup));
+    fixups[num_fixups].pos = text_len;
+    fixups[num_fixups].target = target;
+    num_fixups++;
+    out32(0);
+}
+
+// callと、末尾呼び出しのjmpは関数のシンボルへの相対アドレスを再配置で埋める
+static void encode_call(int opcode, Operand *sym) {
+    out8(opcode);
+    relocs = grow(relocs, &reloc_cap, num_relocs, sizeof(Reloc));
+    relocs[num_relocs].offset = text_len;
+    relocs[num_relocs].symbol = intern_symbol(sym->str, sym->len);
+    num_relocs++;
+    out32(0);
+}
+
+static void encode_insn(Insn *insn) {
+    Operand *dst = &insn->dst;
+    Operand *src = &insn->src;
+
+    switch (insn->op) {
+    case I_NOP:
+    case I_COMMENT:
+        return;
+    case I_LABEL:
+        if (dst->kind == OPD_SYM) {
+            int sym = intern_symbol(dst->str, dst->len);
+            symbols[sym].offset = text_len;
+        }
+        return;
+    case I_ALIGN:
+        pad_nops(1 << dst->val);
+        return;
+    case I_GLOBL: {
+        int sym = intern_symbol(dst->str, dst->len);
+        symbols[sym].global = true;
+        return;
+    }
+    }
+
+    stats.insns++;
+    switch (insn->op) {
+    case I_MOV:
+        encode_mov(dst, src);
+        return;
+    case I_LEA:
+        encode_rm(true, 0x8d, dst->reg, src);
+        return;
+    case I_ADD:
+        encode_alu(0, dst, src);
+        return;
+    case I_AND:
+        encode_alu(4, dst, src);
+        return;
+    case I_SUB:
+        encode_alu(5, dst, src);
+        return;
+    case I_CMP:
+        encode_alu(7, dst, src);
+        return;
+    case I_IMUL:
+        encode_imul(dst, src);
+        return;
+    case I_NEG:
+        encode_rm(true, 0xf7, 3, dst);
+        return;
+    case I_CQO:
+        out8(0x48);
+        out8(0x99);
+        return;
+    case I_SHL:
+    case I_SHR:
+    case I_SAR: {
+        static int digit[] = {[I_SHL] = 4, [I_SHR] = 5, [I_SAR] = 7};
+        encode_rm(true, 0xc1, digit[insn->op], dst);
+        out8(src->val);
+        return;
+    }
+    case I_IMUL1:
+        encode_rm(true, 0xf7, 5, dst);
+        return;
+    case I_IDIV:
+        encode_rm(true, 0xf7, 7, dst);
+        return;
+    case I_SETE:
+    case I_SETNE:
+    case I_SETL:
+    case I_SETLE:
+    case I_SETG:
+    case I_SETGE: {
+        static int cc[] = {[I_SETE] = 0x94, [I_SETNE] = 0x95, [I_SETL] = 0x9c,
+                           [I_SETLE] = 0x9e, [I_SETG] = 0x9f, [I_SETGE] = 0x9d};
+        rex(false, 0, dst, true);
+        out8(0x0f);
+        out8(cc[insn->op]);
+        modrm(0, dst);
+        return;
+    }
+    case I_MOVZB:
+        encode_rm(true, 0x0fb6, dst->reg, src);
+        return;
+    case I_PUSH:
+        encode_push(dst);
+        return;
+    case I_POP:
+        encode_pop(dst);
+        return;
+    case I_JMP:
+        if (dst->kind == OPD_SYM) {
+            encode_call(0xe9, dst);
+            return;
+        }
+        out8(0xe9);
+        encode_jump(dst);
+        return;
+    case I_JE:
+    case I_JNE:
+    case I_JL:
+    case I_JLE:
+    case I_JG:
+    case I_JGE: {
+        static int cc[] = {[I_JE] = 0x84, [I_JNE] = 0x85, [I_JL] = 0x8c,
+                           [I_JLE] = 0x8e, [I_JG] = 0x8f, [I_JGE] = 0x8d};
+        out8(0x0f);
+        out8(cc[insn->op]);
+        encode_jump(dst);
+        return;
+    }
+    case I_CALL:
+        encode_call(0xe8, dst);
+        return;
+    case I_RET:
+        out8(0xc3);
+        return;
+    }
+    error("符号化できない命令です: %d", insn->op);
+}
+
+// insnsをtextに機械語として書き出し、シンボルと再配置を集める
+void encode() {
+    text_len = 0;
+    num_symbols = 0;
+    num_relocs = 0;
+    num_fixups = 0;
+    symbol_table_cap = 0;
+
+    index_labels();
+    insn_offset = realloc(insn_offset, sizeof(int) * (num_insns + 1));
+    if (insn_offset == NULL)
+        error("メモリを確保できません");
+
+    for (int i = 0; i < num_insns; i++) {
+        insn_offset[i] = text_len;
+        encode_insn(&insns[i]);
+    }
+
+    for (int i = 0; i < num_fixups; i++) {
+        Fixup *fix = &fixups[i];
+        long rel = insn_offset[fix->target] - (fix->pos + 4);
+        for (int j = 0; j < 4; j++)
+            text[fix->pos + j] = rel >> (j * 8);
+    }
+}
+
+// スレッドの作業領域を解放する
+void free_encode() {
+    free(text);
+    free(symbols);
+    free(relocs);
+    free(symbol_table);
+    free(insn_offset);
+    free(fixups);
+    text = NULL;
+    symbols = NULL;
+    relocs = NULL;
+    symbol_table = NULL;
+    insn_offset = NULL;
+    fixups = NULL;
+    text_len = text_cap = 0;
+    num_symbols = symbol_cap = 0;
+    num_relocs = reloc_cap = 0;
+    symbol_table_cap = 0;
+    num_fixups = fixup_cap = 0;
+}
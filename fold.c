@@ -0,0 +1,259 @@
+#include "9cc.h"
+
+//
+// 定数畳み込みと代数的な簡約
+// program()で作った抽象構文木をコード生成の前に書き換える
+//
+
+static bool is_num(Node *node, long val) {
+    return node->kind == ND_NUM && node->val == val;
+}
+
+// 代入や関数呼び出し、ゼロ除算の可能性を含む式は消してはいけない
+static bool has_side_effects(Node *node) {
+    if (node == NULL)
+        return false;
+    switch (node->kind) {
+    case ND_ASSIGN:
+    case ND_CALL:
+    case ND_DIV:
+        return true;
+    default:
+        return has_side_effects(node->lhs) || has_side_effects(node->rhs);
+    }
+}
+
+static Node *to_num(Node *node, long val) {
+    node->kind = ND_NUM;
+    node->lhs = NULL;
+    node->rhs = NULL;
+    node->val = val;
+    return node;
+}
+
+// 両辺が定数の二項演算を計算する
+// 実行時と同じ64bitのラップアラウンドになるようunsignedで計算する
+static bool eval_binary(NodeKind kind, long l, long r, long *val) {
+    switch (kind) {
+    case ND_ADD:
+        *val = (long)((unsigned long)l + (unsigned long)r);
+        return true;
+    case ND_SUB:
+        *val = (long)((unsigned long)l - (unsigned long)r);
+        return true;
+    case ND_MUL:
+        *val = (long)((unsigned long)l * (unsigned long)r);
+        return true;
+    case ND_DIV:
+        // 実行時に例外になる割り算はそのまま残す
+        if (r == 0 || (l == LONG_MIN && r == -1))
+            return false;
+        *val = l / r;
+        return true;
+    case ND_EQ:
+        *val = l == r;
+        return true;
+    case ND_NE:
+        *val = l != r;
+        return true;
+    case ND_LT:
+        *val = l < r;
+        return true;
+    case ND_LE:
+        *val = l <= r;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_commutative(NodeKind kind) {
+    return kind == ND_ADD || kind == ND_MUL || kind == ND_EQ || kind == ND_NE;
+}
+
+// 子ノードが簡約済みのnodeを簡約する
+// 書き換えた後のnodeも子ノードは簡約済みなので、そのまま再度simplifyにかけられる
+static Node *simplify(Node *node) {
+    Node *lhs = node->lhs;
+    Node *rhs = node->rhs;
+
+    if (node->kind == ND_NEG) {
+        if (lhs->kind == ND_NUM)
+            return to_num(node, (long)-(unsigned long)lhs->val);
+        // -(-x) => x
+        if (lhs->kind == ND_NEG)
+            return lhs->lhs;
+        return node;
+    }
+
+    long val;
+    if (lhs->kind == ND_NUM && rhs->kind == ND_NUM &&
+        eval_binary(node->kind, lhs->val, rhs->val, &val))
+        return to_num(node, val);
+
+    // 可換な演算は定数を右辺に寄せる
+    if (is_commutative(node->kind) && lhs->kind == ND_NUM) {
+        node->lhs = rhs;
+        node->rhs = lhs;
+        lhs = node->lhs;
+        rhs = node->rhs;
+    }
+
+    switch (node->kind) {
+    case ND_ADD:
+        // x + 0 => x
+        if (is_num(rhs, 0))
+            return lhs;
+        // (x + c1) + c2 => x + (c1 + c2)
+        if (rhs->kind == ND_NUM && lhs->kind == ND_ADD && lhs->rhs->kind == ND_NUM) {
+            eval_binary(ND_ADD, lhs->rhs->val, rhs->val, &val);
+            node->lhs = lhs->lhs;
+            to_num(rhs, val);
+            return simplify(node);
+        }
+        return node;
+    case ND_SUB:
+        // x - 0 => x
+        if (is_num(rhs, 0))
+            return lhs;
+        // 0 - x => -x
+        if (is_num(lhs, 0)) {
+            node->kind = ND_NEG;
+            node->lhs = rhs;
+            node->rhs = NULL;
+            return simplify(node);
+        }
+        // x - c => x + (-c)
+        if (rhs->kind == ND_NUM && rhs->val != LONG_MIN) {
+            node->kind = ND_ADD;
+            rhs->val = -rhs->val;
+            return simplify(node);
+        }
+        return node;
+    case ND_MUL:
+        // x * 1 => x
+        if (is_num(rhs, 1))
+            return lhs;
+        // x * 0 => 0
+        if (is_num(rhs, 0) && !has_side_effects(lhs))
+            return to_num(node, 0);
+        // x * -1 => -x
+        if (is_num(rhs, -1)) {
+            node->kind = ND_NEG;
+            node->rhs = NULL;
+            return simplify(node);
+        }
+        // (x * c1) * c2 => x * (c1 * c2)
+        if (rhs->kind == ND_NUM && lhs->kind == ND_MUL && lhs->rhs->kind == ND_NUM) {
+            eval_binary(ND_MUL, lhs->rhs->val, rhs->val, &val);
+            node->lhs = lhs->lhs;
+            to_num(rhs, val);
+            return simplify(node);
+        }
+        return node;
+    case ND_DIV:
+        // x / 1 => x
+        if (is_num(rhs, 1))
+            return lhs;
+        return node;
+    case ND_LT:
+        // x < c => x <= c - 1
+        // 定数との比較は<=にそろえる
+        if (rhs->kind == ND_NUM && rhs->val != LONG_MIN) {
+            node->kind = ND_LE;
+            rhs->val--;
+        }
+        return node;
+    }
+    return node;
+}
+
+static Node *fold_expr(Node *node) {
+    if (node == NULL)
+        return NULL;
+
+    switch (node->kind) {
+    case ND_NUM:
+    case ND_LVAR:
+        return node;
+    case ND_ASSIGN:
+        // 左辺は変数のまま残す
+        node->rhs = fold_expr(node->rhs);
+        return node;
+    case ND_CALL:
+        for (NDList *arg = node->args; arg; arg = arg->next)
+            arg->node = fold_expr(arg->node);
+        return node;
+    }
+
+    node->lhs = fold_expr(node->lhs);
+    node->rhs = fold_expr(node->rhs);
+    return simplify(node);
+}
+
+// 何もしない文
+static Node *empty_stmt(Node *node) {
+    node->kind = ND_BLOCK;
+    node->block = new_ndlist();
+    return node;
+}
+
+static Node *fold_stmt(Node *node) {
+    switch (node->kind) {
+    case ND_EXPR_STMT:
+    case ND_RETURN:
+        node->lhs = fold_expr(node->lhs);
+        return node;
+    case ND_IF:
+    case ND_IF_ELSE:
+        node->cond = fold_expr(node->cond);
+        node->lhs = fold_stmt(node->lhs);
+        if (node->els)
+            node->els = fold_stmt(node->els);
+        // 条件が定数なら実行される側だけを残す
+        if (node->cond->kind == ND_NUM) {
+            if (node->cond->val)
+                return node->lhs;
+            if (node->els)
+                return node->els;
+            return empty_stmt(node);
+        }
+        return node;
+    case ND_WHILE:
+        node->cond = fold_expr(node->cond);
+        node->lhs = fold_stmt(node->lhs);
+        if (is_num(node->cond, 0))
+            return empty_stmt(node);
+        return node;
+    case ND_FOR:
+        node->init = fold_expr(node->init);
+        node->cond = fold_expr(node->cond);
+        node->inc = fold_expr(node->inc);
+        node->lhs = fold_stmt(node->lhs);
+        // 常に真の条件は省略したのと同じ
+        if (node->cond && node->cond->kind == ND_NUM && node->cond->val)
+            node->cond = NULL;
+        // 常に偽なら初期化式だけが残る
+        // 式文にすると値が関数の返り値になってしまうので、forのまま本体を捨てる
+        if (node->cond && is_num(node->cond, 0)) {
+            if (node->init == NULL)
+                return empty_stmt(node);
+            node->lhs = empty_stmt(node->lhs);
+            node->inc = NULL;
+            return node;
+        }
+        return node;
+    case ND_BLOCK:
+        for (NDList *cur = node->block; cur->node; cur = cur->next)
+            cur->node = fold_stmt(cur->node);
+        return node;
+    }
+    return node;
+}
+
+// 全ての関数の文を簡約する
+void fold() {
+    for (Function *fn = functions; fn; fn = fn->next)
+        for (int i = 0; fn->code[i]; i++)
+            fn->code[i] = fold_stmt(fn->code[i]);
+}
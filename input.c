@@ -0,0 +1,126 @@
+#include "9cc.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//
+// ソースファイルの読み込み
+// トークナイザはNUL終端された文字列を読むので、どの読み方でも末尾にNULを置く
+//
+
+// SIMDのスキャナがアラインされたブロックで読むので、その分の余白
+#define PADDING 32
+
+// read_fileが返したバッファ。free_fileで解放するために覚えておく
+typedef struct Buffer Buffer;
+struct Buffer {
+    Buffer *next;
+    char *buf;
+    size_t len;     // マップした大きさ。mallocしたものなら0
+};
+
+static _Thread_local Buffer *buffers;
+
+static char *remember(char *buf, size_t len) {
+    Buffer *b = calloc(1, sizeof(Buffer));
+    b->next = buffers;
+    b->buf = buf;
+    b->len = len;
+    buffers = b;
+    return buf;
+}
+
+// 標準入力など、大きさのわからない入力をバッファに読み込む
+static char *read_stream(int fd, char *path) {
+    size_t cap = 1 << 16;
+    size_t len = 0;
+    char *buf = malloc(cap + PADDING);
+
+    for (;;) {
+        if (len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap + PADDING);
+        }
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n < 0)
+            error("%s: 読み込みに失敗しました", path);
+        if (n == 0)
+            break;
+        len += n;
+    }
+
+    memset(buf + len, 0, PADDING);
+    return remember(buf, 0);
+}
+
+// 通常のファイルはコピーせずにメモリにマップする
+// ファイルの直後に0で埋めたページを置いてNUL終端にする
+static char *map_file(int fd, size_t size) {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t len = (size + PADDING + page) & ~(size_t)(page - 1);
+
+    char *buf = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+        return NULL;
+    if (size && mmap(buf, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(buf, len);
+        return NULL;
+    }
+    return remember(buf, len);
+}
+
+// pathの内容をNUL終端された文字列として返す。"-"なら標準入力を読む
+char *read_file(char *path) {
+    if (!strcmp(path, "-"))
+        return read_stream(STDIN_FILENO, path);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        error("%s: ファイルを開けません: %s", path, strerror(errno));
+
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        buf = map_file(fd, st.st_size);
+    if (buf == NULL)
+        buf = read_stream(fd, path);
+    close(fd);
+    return buf;
+}
+
+// read_fileが返したバッファを解放する
+void free_file(char *buf) {
+    for (Buffer **p = &buffers; *p; p = &(*p)->next) {
+        Buffer *b = *p;
+        if (b->buf != buf)
+            continue;
+        if (b->len)
+            munmap(b->buf, b->len);
+        else
+            free(b->buf);
+        *p = b->next;
+        free(b);
+        return;
+    }
+}
+
+// fpからdelimまでを1つの入力として読む。delimは含めない
+// 返すバッファは次の呼び出しで使い回す。入力の終わりならNULL
+char *read_record(FILE *fp, int delim) {
+    static _Thread_local char *buf;
+    static _Thread_local size_t cap;
+    ssize_t len = getdelim(&buf, &cap, delim, fp);
+    if (len < 0)
+        return NULL;
+    if (len > 0 && buf[len - 1] == delim)
+        len--;
+    if (cap < len + PADDING) {
+        cap = len + PADDING;
+        buf = realloc(buf, cap);
+        if (buf == NULL)
+            error("メモリを確保できません");
+    }
+    memset(buf + len, 0, PADDING);
+    return buf;
+}
@@ -0,0 +1,599 @@
+#include "9cc.h"
+
+//
+// 中間表現
+// lowerが抽象構文木から作り、codegenがx86-64の命令列にする
+//
+// lowerはブロックを1つずつ終端命令まで埋めてから次のブロックに移るので、
+// 各ブロックの命令はirsの連続した範囲になり、irsの並びがそのまま配置順になる。
+//
+
+_Thread_local IR *irs;
+_Thread_local int num_irs;
+static _Thread_local int ir_cap;
+
+_Thread_local int *ir_args;
+static _Thread_local int num_ir_args;
+static _Thread_local int ir_args_cap;
+
+_Thread_local Block *blocks;
+_Thread_local int num_blocks;
+static _Thread_local int block_cap;
+
+_Thread_local int *layout;
+_Thread_local int num_layout;
+static _Thread_local int layout_cap;
+
+_Thread_local int num_vregs;
+
+// 命令を足しているブロック。終端命令を足した後は-1
+static _Thread_local int current;
+
+static void *grow(void *p, int *cap, int n, size_t size) {
+    if (n < *cap)
+        return p;
+    *cap = *cap ? *cap * 2 : 1024;
+    p = realloc(p, size * *cap);
+    if (p == NULL)
+        error("メモリを確保できません");
+    return p;
+}
+
+//
+// IRを作る
+//
+
+void reset_ir() {
+    num_irs = 0;
+    num_ir_args = 0;
+    num_blocks = 0;
+    num_layout = 0;
+    num_vregs = 0;
+    current = -1;
+}
+
+int new_vreg() {
+    return ++num_vregs;
+}
+
+// まだ命令のないブロックを作る。start_blockで配置するまで位置は決まらない
+int new_block() {
+    blocks = grow(blocks, &block_cap, num_blocks, sizeof(Block));
+    Block *b = &blocks[num_blocks];
+    b->start = b->end = -1;
+    b->reachable = false;
+    b->loop = false;
+    return num_blocks++;
+}
+
+static bool is_terminator(IROp op) {
+    return op == IR_JMP || op == IR_BR || op == IR_RET;
+}
+
+// bを今のブロックの次に配置して、以降の命令をbに足す
+// 今のブロックが終端していなければbへのジャンプで終える
+void start_block(int b) {
+    if (blocks[b].start >= 0)
+        error("ブロック%dは配置済みです", b);
+    if (current >= 0)
+        emit_ir(IR_JMP)->then = b;
+
+    blocks[b].start = blocks[b].end = num_irs;
+    layout = grow(layout, &layout_cap, num_layout, sizeof(int));
+    layout[num_layout++] = b;
+    current = b;
+}
+
+IR *emit_ir(IROp op) {
+    // 終端命令の後ろの到達しない命令は新しいブロックに入れる
+    if (current < 0)
+        start_block(new_block());
+
+    irs = grow(irs, &ir_cap, num_irs, sizeof(IR));
+    IR *ir = &irs[num_irs++];
+    memset(ir, 0, sizeof(IR));
+    ir->op = op;
+    blocks[current].end = num_irs;
+    if (is_terminator(op))
+        current = -1;
+    stats.irs++;
+    return ir;
+}
+
+// IR_CALLのn個の引数の場所をir_argsに取って先頭の位置を返す
+// 引数の式の中の呼び出しは後ろに取るので、先に取っておけば引数は並ぶ
+int reserve_args(int n) {
+    while (num_ir_args + n > ir_args_cap) {
+        ir_args_cap = ir_args_cap ? ir_args_cap * 2 : 1024;
+        ir_args = realloc(ir_args, sizeof(int) * ir_args_cap);
+        if (ir_args == NULL)
+            error("メモリを確保できません");
+    }
+    num_ir_args += n;
+    return num_ir_args - n;
+}
+
+//
+// 命令とブロックの性質
+//
+
+// irが読む仮想レジスタの数。i番目はir_use(ir, i)
+int num_uses(IR *ir) {
+    switch (ir->op) {
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV:
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+        return 2;
+    case IR_MOV:
+    case IR_NEG:
+    case IR_STORE:
+    case IR_BR:
+    case IR_RET:
+        return 1;
+    case IR_CALL:
+        return ir->num_args;
+    default:
+        return 0;
+    }
+}
+
+int ir_use(IR *ir, int i) {
+    if (ir->op == IR_CALL)
+        return ir_args[ir->args + i];
+    return i == 0 ? ir->a : ir->b;
+}
+
+// ブロックbの後続をsuccに入れて数を返す
+int successors(int b, int *succ) {
+    Block *block = &blocks[b];
+    if (block->start == block->end)
+        return 0;
+    IR *last = &irs[block->end - 1];
+    switch (last->op) {
+    case IR_JMP:
+        succ[0] = last->then;
+        return 1;
+    case IR_BR:
+        succ[0] = last->then;
+        succ[1] = last->els;
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+//
+// テキストでの出力(--dump-ir)
+//
+
+static char *ir_name[] = {
+    [IR_ADD] = "add", [IR_SUB] = "sub", [IR_MUL] = "mul", [IR_DIV] = "div",
+    [IR_EQ] = "eq", [IR_NE] = "ne", [IR_LT] = "lt", [IR_LE] = "le",
+    [IR_NEG] = "neg", [IR_LOAD] = "load", [IR_CALL] = "call",
+};
+
+static void dump_insn(IR *ir) {
+    printf("    ");
+    if (ir->dst)
+        printf("v%d = ", ir->dst);
+
+    switch (ir->op) {
+    case IR_IMM:
+        printf("%ld\n", ir->imm);
+        return;
+    case IR_MOV:
+        printf("v%d\n", ir->a);
+        return;
+    case IR_NEG:
+        printf("neg v%d\n", ir->a);
+        return;
+    case IR_LOAD:
+        printf("load %.*s\n", ir->var->len, ir->var->name);
+        return;
+    case IR_STORE:
+        printf("store %.*s, v%d\n", ir->var->len, ir->var->name, ir->a);
+        return;
+    case IR_CALL:
+        printf("call %.*s(", ir->len, ir->name);
+        for (int i = 0; i < ir->num_args; i++)
+            printf(i ? ", v%d" : "v%d", ir_use(ir, i));
+        printf(")\n");
+        return;
+    case IR_JMP:
+        printf("jmp .B%d\n", ir->then);
+        return;
+    case IR_BR:
+        printf("br v%d, .B%d, .B%d\n", ir->a, ir->then, ir->els);
+        return;
+    case IR_RET:
+        printf("ret v%d\n", ir->a);
+        return;
+    case IR_NOP:
+        printf("nop\n");
+        return;
+    default:
+        printf("%s v%d, v%d\n", ir_name[ir->op], ir->a, ir->b);
+        return;
+    }
+}
+
+// ブロックを配置順に標準出力に書く
+void dump_ir(Function *fn) {
+    printf("%.*s:\n", fn->len, fn->name);
+    for (int i = 0; i < num_layout; i++) {
+        Block *b = &blocks[layout[i]];
+        if (b->start == b->end)
+            continue;
+        printf(".B%d:\n", layout[i]);
+        for (int j = b->start; j < b->end; j++)
+            dump_insn(&irs[j]);
+    }
+    fflush(stdout);
+}
+
+//
+// 生存解析
+//
+
+_Thread_local int *vreg_global;
+_Thread_local int num_globals;
+_Thread_local int live_words;
+_Thread_local unsigned long *block_live_in;
+_Thread_local unsigned long *block_live_out;
+
+// ブロックごとの、定義より先に読まれる大域的な仮想レジスタと、定義される大域的な仮想レジスタ
+static _Thread_local unsigned long *block_use;
+static _Thread_local unsigned long *block_def;
+
+static _Thread_local int *def_block;
+static _Thread_local int *stack;
+
+#define WORD_BITS (int)(sizeof(unsigned long) * 8)
+
+static unsigned long *bits(unsigned long *set, int b) {
+    return set + (size_t)b * live_words;
+}
+
+static bool test_bit(unsigned long *set, int i) {
+    return set[i / WORD_BITS] >> (i % WORD_BITS) & 1;
+}
+
+static void set_bit(unsigned long *set, int i) {
+    set[i / WORD_BITS] |= 1ul << (i % WORD_BITS);
+}
+
+static void clear_bit(unsigned long *set, int i) {
+    set[i / WORD_BITS] &= ~(1ul << (i % WORD_BITS));
+}
+
+bool live_in_block(int b, int g) {
+    return test_bit(bits(block_live_in, b), g);
+}
+
+bool live_out_block(int b, int g) {
+    return test_bit(bits(block_live_out, b), g);
+}
+
+// 入口のブロックから辿れるブロックに印を付ける
+static void mark_reachable() {
+    stack = realloc(stack, sizeof(int) * (num_blocks + 1));
+    for (int b = 0; b < num_blocks; b++)
+        blocks[b].reachable = false;
+    if (num_layout == 0)
+        return;
+
+    int sp = 0;
+    blocks[layout[0]].reachable = true;
+    stack[sp++] = layout[0];
+    while (sp > 0) {
+        int succ[2];
+        int n = successors(stack[--sp], succ);
+        for (int i = 0; i < n; i++) {
+            if (blocks[succ[i]].reachable)
+                continue;
+            blocks[succ[i]].reachable = true;
+            stack[sp++] = succ[i];
+        }
+    }
+}
+
+// 定義されたブロックの外や定義より前で読まれる仮想レジスタに通し番号を振る
+// 式の途中結果はほとんどブロックの中で閉じているので、集合は小さくて済む
+static void number_globals() {
+    vreg_global = realloc(vreg_global, sizeof(int) * (num_vregs + 1));
+    def_block = realloc(def_block, sizeof(int) * (num_vregs + 1));
+    if (vreg_global == NULL || def_block == NULL)
+        error("メモリを確保できません");
+    for (int v = 0; v <= num_vregs; v++) {
+        vreg_global[v] = -1;
+        def_block[v] = -1;
+    }
+
+    num_globals = 0;
+    for (int i = 0; i < num_layout; i++) {
+        int b = layout[i];
+        for (int j = blocks[b].start; j < blocks[b].end; j++) {
+            IR *ir = &irs[j];
+            for (int k = 0; k < num_uses(ir); k++) {
+                int v = ir_use(ir, k);
+                if (def_block[v] != b && vreg_global[v] < 0)
+                    vreg_global[v] = num_globals++;
+            }
+            if (ir->dst)
+                def_block[ir->dst] = b;
+        }
+    }
+    live_words = (num_globals + WORD_BITS - 1) / WORD_BITS;
+}
+
+static unsigned long *alloc_sets(unsigned long *set) {
+    size_t size = sizeof(unsigned long) * (live_words * (num_blocks + 1) + 1);
+    set = realloc(set, size);
+    if (set == NULL)
+        error("メモリを確保できません");
+    memset(set, 0, size);
+    return set;
+}
+
+// 到達可能性と、ブロックの入口と出口で生きている大域的な仮想レジスタを求める
+void analyze_ir() {
+    mark_reachable();
+    number_globals();
+
+    block_use = alloc_sets(block_use);
+    block_def = alloc_sets(block_def);
+    block_live_in = alloc_sets(block_live_in);
+    block_live_out = alloc_sets(block_live_out);
+    if (num_globals == 0)
+        return;
+
+    for (int b = 0; b < num_blocks; b++) {
+        unsigned long *use = bits(block_use, b);
+        unsigned long *def = bits(block_def, b);
+        for (int j = blocks[b].start; j < blocks[b].end; j++) {
+            IR *ir = &irs[j];
+            for (int k = 0; k < num_uses(ir); k++) {
+                int g = vreg_global[ir_use(ir, k)];
+                if (g >= 0 && !test_bit(def, g))
+                    set_bit(use, g);
+            }
+            if (ir->dst && vreg_global[ir->dst] >= 0)
+                set_bit(def, vreg_global[ir->dst]);
+        }
+    }
+
+    // 配置の逆順に辿ると、ループ以外は1回で収束する
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = num_layout - 1; i >= 0; i--) {
+            int b = layout[i];
+            unsigned long *in = bits(block_live_in, b);
+            unsigned long *out = bits(block_live_out, b);
+            unsigned long *use = bits(block_use, b);
+            unsigned long *def = bits(block_def, b);
+
+            int succ[2];
+            int n = successors(b, succ);
+            for (int w = 0; w < live_words; w++) {
+                unsigned long o = 0;
+                for (int s = 0; s < n; s++)
+                    o |= bits(block_live_in, succ[s])[w];
+                out[w] = o;
+                unsigned long x = use[w] | (o & ~def[w]);
+                if (x != in[w]) {
+                    in[w] = x;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+//
+// 検査
+// lowerや最適化の誤りを、x86の命令列になる前に見つける
+//
+
+static _Noreturn void invalid(int b, int i, char *msg) {
+    error("IRが不正です: .B%d の %d 番目の命令: %s", b, i - blocks[b].start, msg);
+}
+
+static bool valid_vreg(int v) {
+    return 0 < v && v <= num_vregs;
+}
+
+static bool valid_block(int b) {
+    return 0 <= b && b < num_blocks && blocks[b].start >= 0;
+}
+
+static bool has_dst(IROp op) {
+    return op != IR_STORE && !is_terminator(op) && op != IR_NOP;
+}
+
+void verify_ir() {
+    if (num_layout == 0)
+        error("IRが不正です: ブロックがありません");
+
+    for (int i = 0; i < num_blocks; i++)
+        if (blocks[i].start < 0)
+            error("IRが不正です: .B%d が配置されていません", i);
+
+    analyze_ir();
+
+    for (int i = 0; i < num_layout; i++) {
+        int b = layout[i];
+        Block *block = &blocks[b];
+        if (block->start == block->end) {
+            // 到達しないブロックは最適化で空になる
+            if (block->reachable)
+                error("IRが不正です: .B%d が空です", b);
+            continue;
+        }
+
+        for (int j = block->start; j < block->end; j++) {
+            IR *ir = &irs[j];
+            bool last = j == block->end - 1;
+            if (is_terminator(ir->op) != last)
+                invalid(b, j, last ? "終端命令で終わっていません" : "終端命令が途中にあります");
+            if (has_dst(ir->op) != (ir->dst != 0))
+                invalid(b, j, "結果の仮想レジスタが不正です");
+            if (ir->dst && !valid_vreg(ir->dst))
+                invalid(b, j, "仮想レジスタの番号が範囲外です");
+            for (int k = 0; k < num_uses(ir); k++) {
+                int v = ir_use(ir, k);
+                if (!valid_vreg(v))
+                    invalid(b, j, "仮想レジスタの番号が範囲外です");
+                if (def_block[v] < 0)
+                    invalid(b, j, "定義されていない仮想レジスタを読んでいます");
+            }
+            if ((ir->op == IR_LOAD || ir->op == IR_STORE) && ir->var == NULL)
+                invalid(b, j, "変数がありません");
+            if ((ir->op == IR_JMP || ir->op == IR_BR) && !valid_block(ir->then))
+                invalid(b, j, "分岐先のブロックが不正です");
+            if (ir->op == IR_BR && !valid_block(ir->els))
+                invalid(b, j, "分岐先のブロックが不正です");
+        }
+    }
+
+    // 入口で生きている値は、どこかの経路で定義される前に読まれている
+    int entry = layout[0];
+    for (int g = 0; g < num_globals; g++)
+        if (live_in_block(entry, g))
+            error("IRが不正です: 定義される前に読まれる仮想レジスタがあります");
+}
+
+//
+// 不要な命令の削除
+//
+
+static _Thread_local bool *local_live;
+static _Thread_local unsigned long *live;
+
+static bool has_side_effects(IR *ir) {
+    return ir->op == IR_STORE || ir->op == IR_CALL || ir->op == IR_DIV || is_terminator(ir->op);
+}
+
+// 到達しないブロックの命令を消す
+static bool remove_unreachable() {
+    bool changed = false;
+    for (int b = 0; b < num_blocks; b++) {
+        if (blocks[b].reachable)
+            continue;
+        for (int j = blocks[b].start; j < blocks[b].end; j++) {
+            changed |= irs[j].op != IR_NOP;
+            irs[j].op = IR_NOP;
+            irs[j].dst = 0;
+        }
+    }
+    return changed;
+}
+
+// 結果が読まれない命令を各ブロックの後ろから消す
+// 大域的な値は出口での生存情報から、ブロックの中で閉じた値は出口では死んでいるとして始める
+static bool remove_dead_values() {
+    local_live = realloc(local_live, sizeof(bool) * (num_vregs + 1));
+    live = realloc(live, sizeof(unsigned long) * (live_words + 1));
+    if (local_live == NULL || live == NULL)
+        error("メモリを確保できません");
+    memset(local_live, 0, sizeof(bool) * (num_vregs + 1));
+
+    bool changed = false;
+    for (int b = 0; b < num_blocks; b++) {
+        memcpy(live, bits(block_live_out, b), sizeof(unsigned long) * live_words);
+        for (int j = blocks[b].end - 1; j >= blocks[b].start; j--) {
+            IR *ir = &irs[j];
+            if (ir->op == IR_NOP)
+                continue;
+
+            if (ir->dst) {
+                int g = vreg_global[ir->dst];
+                bool dead = g < 0 ? !local_live[ir->dst] : !test_bit(live, g);
+                if (dead && !has_side_effects(ir)) {
+                    ir->op = IR_NOP;
+                    ir->dst = 0;
+                    changed = true;
+                    continue;
+                }
+                if (g < 0)
+                    local_live[ir->dst] = false;
+                else
+                    clear_bit(live, g);
+            }
+
+            for (int k = 0; k < num_uses(ir); k++) {
+                int v = ir_use(ir, k);
+                if (vreg_global[v] < 0)
+                    local_live[v] = true;
+                else
+                    set_bit(live, vreg_global[v]);
+            }
+        }
+    }
+    return changed;
+}
+
+// 消した命令を詰める。ブロックの範囲も合わせて動かす
+static void compact() {
+    int n = 0;
+    for (int i = 0; i < num_layout; i++) {
+        Block *b = &blocks[layout[i]];
+        int start = n;
+        for (int j = b->start; j < b->end; j++)
+            if (irs[j].op != IR_NOP)
+                irs[n++] = irs[j];
+        b->start = start;
+        b->end = n;
+    }
+    num_irs = n;
+}
+
+// 到達しないブロックと、結果が使われない命令を消す
+// analyze_irの結果が新しい前提で、消した後の結果は作り直さない
+void eliminate_dead_code() {
+    for (;;) {
+        bool changed = remove_unreachable();
+        changed |= remove_dead_values();
+        if (!changed)
+            break;
+        analyze_ir();
+    }
+    compact();
+}
+
+// スレッドの作業領域を解放する
+void free_ir() {
+    free(irs);
+    free(ir_args);
+    free(blocks);
+    free(layout);
+    irs = NULL;
+    ir_args = NULL;
+    blocks = NULL;
+    layout = NULL;
+    num_irs = ir_cap = 0;
+    num_ir_args = ir_args_cap = 0;
+    num_blocks = block_cap = 0;
+    num_layout = layout_cap = 0;
+
+    free(vreg_global);
+    free(block_live_in);
+    free(block_live_out);
+    free(block_use);
+    free(block_def);
+    free(def_block);
+    free(stack);
+    free(local_live);
+    free(live);
+    vreg_global = NULL;
+    block_live_in = block_live_out = NULL;
+    block_use = block_def = NULL;
+    def_block = stack = NULL;
+    local_live = NULL;
+    live = NULL;
+}
@@ -0,0 +1,123 @@
+#include "9cc.h"
+
+//
+// 命令選択
+// 1回しか使われない即値と変数の読み出しは、レジスタに置かずに
+// 使う側の命令のオペランド(imm32や[rbp-N]、変数を置いたレジスタ)として埋め込む
+// どの命令のどのオペランドに何を埋め込めるかは表で決めておく
+//
+
+#define T_IMM32 1   // 32bitに収まる即値
+#define T_IMM   2   // 任意の即値
+#define T_MEM   4   // 変数の場所。[rbp-N]か、変数を置いたレジスタ
+
+// [op][0]はa、[op][1]はbに埋め込めるもの。IR_CALLの[0]は引数すべて
+static int tiles[][2] = {
+    [IR_MOV] = {T_IMM | T_MEM},
+    [IR_ADD] = {T_IMM32 | T_MEM, T_IMM32 | T_MEM},
+    [IR_SUB] = {T_IMM32 | T_MEM, T_IMM32 | T_MEM},
+    [IR_MUL] = {T_IMM32 | T_MEM, T_IMM32 | T_MEM},
+    [IR_DIV] = {T_IMM | T_MEM, T_IMM | T_MEM},
+    [IR_EQ] = {T_IMM32 | T_MEM, T_IMM32 | T_MEM},
+    [IR_NE] = {T_IMM32 | T_MEM, T_IMM32 | T_MEM},
+    [IR_LT] = {T_IMM32 | T_MEM, T_IMM32 | T_MEM},
+    [IR_LE] = {T_IMM32 | T_MEM, T_IMM32 | T_MEM},
+    [IR_NEG] = {T_IMM | T_MEM},
+    [IR_STORE] = {T_IMM | T_MEM},
+    [IR_CALL] = {T_IMM32 | T_MEM},
+    [IR_BR] = {T_MEM},
+    [IR_RET] = {T_IMM | T_MEM},
+};
+
+_Thread_local Operand *vreg_tile;
+
+static _Thread_local int *num_defs;
+static _Thread_local int *use_count;
+static _Thread_local int *def_pos;
+static _Thread_local int *store_pos;    // 変数ごとの最後の書き込みの位置
+
+static int *alloc_ints(int *p, int n) {
+    p = realloc(p, sizeof(int) * (n + 1));
+    if (p == NULL)
+        error("メモリを確保できません");
+    return p;
+}
+
+// 仮想レジスタvの定義をinsnのk番目のオペランドに埋め込めるなら、その形を返す
+static Operand tile(int v, IR *insn, int k) {
+    Operand none = {OPD_NONE};
+    if (num_defs[v] != 1 || use_count[v] != 1)
+        return none;
+
+    int t = tiles[insn->op][insn->op == IR_CALL ? 0 : k];
+    IR *def = &irs[def_pos[v]];
+    switch (def->op) {
+    case IR_IMM:
+        if ((t & T_IMM) || ((t & T_IMM32) && def->imm == (int)def->imm))
+            return imm_op(def->imm);
+        return none;
+    case IR_LOAD:
+        // 読んでから使うまでの間に書き換えられていたら埋め込めない
+        if ((t & T_MEM) && store_pos[def->var->offset / 8] < def_pos[v])
+            return var_loc(def->var);
+        return none;
+    default:
+        return none;
+    }
+}
+
+// 埋め込む仮想レジスタをvreg_tileに決める。埋め込まないものはOPD_NONE
+void select_operands() {
+    int num_vars = locals->offset / 8;
+    num_defs = alloc_ints(num_defs, num_vregs);
+    use_count = alloc_ints(use_count, num_vregs);
+    def_pos = alloc_ints(def_pos, num_vregs);
+    store_pos = alloc_ints(store_pos, num_vars);
+    vreg_tile = realloc(vreg_tile, sizeof(Operand) * (num_vregs + 1));
+    if (vreg_tile == NULL)
+        error("メモリを確保できません");
+
+    for (int i = 0; i <= num_vars; i++)
+        store_pos[i] = -1;
+    for (int v = 0; v <= num_vregs; v++) {
+        num_defs[v] = use_count[v] = 0;
+        def_pos[v] = -1;
+        vreg_tile[v] = (Operand){OPD_NONE};
+    }
+    for (int j = 0; j < num_irs; j++) {
+        IR *ir = &irs[j];
+        for (int k = 0; k < num_uses(ir); k++)
+            use_count[ir_use(ir, k)]++;
+        if (ir->dst)
+            num_defs[ir->dst]++;
+    }
+
+    // 配置順に見るので、store_posは常にそこまでで最後の書き込みになる
+    for (int i = 0; i < num_layout; i++) {
+        int b = layout[i];
+        for (int j = blocks[b].start; j < blocks[b].end; j++) {
+            IR *ir = &irs[j];
+            for (int k = 0; k < num_uses(ir); k++) {
+                // 埋め込むのは同じブロックの中で定義されたものだけ
+                int v = ir_use(ir, k);
+                if (def_pos[v] >= blocks[b].start && def_pos[v] < j)
+                    vreg_tile[v] = tile(v, ir, k);
+            }
+            if (ir->op == IR_STORE)
+                store_pos[ir->var->offset / 8] = j;
+            if (ir->dst)
+                def_pos[ir->dst] = j;
+        }
+    }
+}
+
+// スレッドの作業領域を解放する
+void free_isel() {
+    free(vreg_tile);
+    free(num_defs);
+    free(use_count);
+    free(def_pos);
+    free(store_pos);
+    vreg_tile = NULL;
+    num_defs = use_count = def_pos = store_pos = NULL;
+}
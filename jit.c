@@ -0,0 +1,96 @@
+#include "9cc.h"
+#include <dlfcn.h>
+#include <sys/mman.h>
+
+//
+// encodeした機械語をその場で実行する(--run)
+// アセンブラもリンカも使わず、コードを実行可能なメモリに置いてmainを呼ぶ
+//
+// 外部の関数は--loadで読み込んだ共有ライブラリか、9cc自身にリンクされた
+// ライブラリ(libcなど)からdlsymで探す。
+// 呼び出し先はrel32で届くとは限らないので、コードの後ろに
+// 関数ごとの中継 jmp [rip+0]; .quad addr を置いてそこに飛ばす。
+//
+
+#define STUB_SIZE 14
+
+static void **libs;
+static int num_libs;
+
+// 外部の関数を探す共有ライブラリを読み込む
+void load_library(char *path) {
+    void *handle = dlopen(path, RTLD_NOW | RTLD_GLOBAL);
+    if (handle == NULL)
+        error("%s", dlerror());
+    libs = realloc(libs, sizeof(void *) * (num_libs + 1));
+    if (libs == NULL)
+        error("メモリを確保できません");
+    libs[num_libs++] = handle;
+}
+
+static void *resolve(Symbol *sym) {
+    char *name = strndup(sym->name, sym->len);
+    void *addr = NULL;
+    for (int i = 0; i < num_libs && !addr; i++)
+        addr = dlsym(libs[i], name);
+    if (!addr)
+        addr = dlsym(RTLD_DEFAULT, name);
+    if (!addr)
+        error("関数%sが見つかりません", name);
+    free(name);
+    return addr;
+}
+
+static void put32(unsigned char *p, long val) {
+    for (int i = 0; i < 4; i++)
+        p[i] = val >> (i * 8);
+}
+
+// encode()の結果を実行してmainの返り値を返す
+long run_jit() {
+    size_t stubs = (text_len + 15) & ~15;
+    size_t size = stubs + (size_t)num_symbols * STUB_SIZE;
+    unsigned char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        error("mmapに失敗しました: %s", strerror(errno));
+    memcpy(mem, text, text_len);
+
+    // 未定義のシンボルごとに中継を作る
+    // 定義済みのシンボルはコードの中の位置がそのまま飛び先になる
+    long *target = calloc(num_symbols, sizeof(long));
+    long (*entry)() = NULL;
+    for (int i = 0; i < num_symbols; i++) {
+        Symbol *sym = &symbols[i];
+        if (sym->offset >= 0) {
+            target[i] = sym->offset;
+            if (sym->len == 4 && !memcmp(sym->name, "main", 4))
+                entry = (long (*)())(mem + sym->offset);
+            continue;
+        }
+
+        unsigned char *stub = mem + stubs + (size_t)i * STUB_SIZE;
+        stub[0] = 0xff;
+        stub[1] = 0x25;
+        put32(stub + 2, 0);
+        void *addr = resolve(sym);
+        memcpy(stub + 6, &addr, 8);
+        target[i] = stub - mem;
+    }
+    if (entry == NULL)
+        error("mainが定義されていません");
+
+    for (int i = 0; i < num_relocs; i++) {
+        Reloc *rel = &relocs[i];
+        put32(mem + rel->offset, target[rel->symbol] - (rel->offset + 4));
+    }
+    free(target);
+
+    // 書き込みと実行は同時に許さない
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) < 0)
+        error("mprotectに失敗しました: %s", strerror(errno));
+
+    long ret = entry();
+    munmap(mem, size);
+    return ret;
+}
@@ -0,0 +1,280 @@
+#include "9cc.h"
+
+//
+// 抽象構文木をIRにする
+// 式の途中結果はそれぞれ新しい仮想レジスタに置き、制御構文はブロックに分ける
+//
+
+// 最後に評価した式文の値を置く仮想レジスタ
+// returnせずに関数の終わりに来たらこれが返り値になる
+static _Thread_local int result;
+
+// IRにしている関数
+static _Thread_local Function *fn;
+
+// いくつのループの中にいるか
+static _Thread_local int loop_depth;
+
+// 関数呼び出しは生きている値を退避させるので、先に評価されるように重くしておく
+#define CALL_REGS 16
+
+static IROp binop[] = {
+    [ND_ADD] = IR_ADD, [ND_SUB] = IR_SUB, [ND_MUL] = IR_MUL, [ND_DIV] = IR_DIV,
+    [ND_EQ] = IR_EQ, [ND_NE] = IR_NE, [ND_LT] = IR_LT, [ND_LE] = IR_LE,
+};
+
+static int gen_expr(Node *node);
+
+static IR *new_ir(IROp op, int a, int b) {
+    IR *ir = emit_ir(op);
+    ir->a = a;
+    ir->b = b;
+    return ir;
+}
+
+// 結果を新しい仮想レジスタに置く命令を足して、その仮想レジスタを返す
+static int new_value(IROp op, int a, int b) {
+    IR *ir = new_ir(op, a, b);
+    ir->dst = new_vreg();
+    return ir->dst;
+}
+
+static void gen_jmp(int block) {
+    new_ir(IR_JMP, 0, 0)->then = block;
+}
+
+// Sethi-Ullman数: nodeの評価に必要なレジスタの数
+static int need_regs(Node *node) {
+    if (node->regs)
+        return node->regs;
+
+    int l, r;
+    switch (node->kind) {
+    case ND_NUM:
+    case ND_LVAR:
+        node->regs = 1;
+        break;
+    case ND_ASSIGN:
+        node->regs = need_regs(node->rhs);
+        break;
+    case ND_NEG:
+        node->regs = need_regs(node->lhs);
+        break;
+    case ND_CALL:
+        node->regs = CALL_REGS;
+        break;
+    default:
+        l = need_regs(node->lhs);
+        r = need_regs(node->rhs);
+        if (l == r)
+            node->regs = l + 1;
+        else
+            node->regs = l > r ? l : r;
+        break;
+    }
+    return node->regs;
+}
+
+// ループの中の読み書きは1段深くなるごとに8倍に数える
+static void count_use(LVar *var) {
+    long w = 1;
+    for (int i = 0; i < loop_depth && i < 6; i++)
+        w *= 8;
+    var->uses += w;
+}
+
+static int new_loop() {
+    int b = new_block();
+    blocks[b].loop = true;
+    return b;
+}
+
+// 条件式を評価して、真ならthenに、偽ならelsに飛ぶ
+static void gen_cond(Node *cond, int then, int els) {
+    IR *ir = new_ir(IR_BR, gen_expr(cond), 0);
+    ir->then = then;
+    ir->els = els;
+}
+
+// 引数の値をすべて仮想レジスタに置いて、ir_argsでの先頭の位置を返す
+static int gen_args(Node *node) {
+    int args = reserve_args(node->num_args);
+    NDList *arg = node->args;
+    for (int i = 0; i < node->num_args; i++, arg = arg->next) {
+        // gen_exprがir_argsを伸ばすことがあるので、先に評価しておく
+        int val = gen_expr(arg->node);
+        ir_args[args + i] = val;
+    }
+    return args;
+}
+
+static bool is_self_call(Node *node) {
+    return node->kind == ND_CALL && node->len == fn->len && !memcmp(node->str, fn->name, fn->len) &&
+           node->num_args == fn->num_params;
+}
+
+// return f(...)で自分自身を呼ぶときは、引数を仮引数に入れ直して先頭に戻るループにする
+// 新しい引数をすべて求めてから書き込むので、古い値を読む引数があっても壊れない
+static void gen_self_tail_call(Node *node) {
+    int args = gen_args(node);
+    for (int i = 0; i < node->num_args; i++) {
+        new_ir(IR_STORE, ir_args[args + i], 0)->var = fn->params[i];
+        count_use(fn->params[i]);
+    }
+    blocks[0].loop = true;
+    gen_jmp(0);
+}
+
+static void gen_stmt(Node *node) {
+    switch (node->kind) {
+    case ND_EXPR_STMT:
+        new_ir(IR_MOV, gen_expr(node->lhs), 0)->dst = result;
+        return;
+    case ND_RETURN:
+        if (is_self_call(node->lhs)) {
+            gen_self_tail_call(node->lhs);
+            return;
+        }
+        new_ir(IR_RET, gen_expr(node->lhs), 0);
+        return;
+    case ND_IF: {
+        int then = new_block();
+        int end = new_block();
+        gen_cond(node->cond, then, end);
+        start_block(then);
+        gen_stmt(node->lhs);
+        start_block(end);
+        return;
+    }
+    case ND_IF_ELSE: {
+        int then = new_block();
+        int els = new_block();
+        int end = new_block();
+        gen_cond(node->cond, then, els);
+        start_block(then);
+        gen_stmt(node->lhs);
+        gen_jmp(end);
+        start_block(els);
+        gen_stmt(node->els);
+        start_block(end);
+        return;
+    }
+    // ループは入口で一度条件を調べてから、条件を末尾に置いたdo-whileにする
+    // 1周あたりの分岐が後ろへの条件付きジャンプ1つで済む
+    case ND_WHILE: {
+        int body = new_loop();
+        int end = new_block();
+        gen_cond(node->cond, body, end);
+        start_block(body);
+        loop_depth++;
+        gen_stmt(node->lhs);
+        gen_cond(node->cond, body, end);
+        loop_depth--;
+        start_block(end);
+        return;
+    }
+    case ND_FOR: {
+        // 条件が常に偽なら初期化式を評価するだけ
+        if (node->cond && node->cond->kind == ND_NUM && node->cond->val == 0) {
+            if (node->init)
+                gen_expr(node->init);
+            return;
+        }
+        int body = new_loop();
+        int end = new_block();
+        if (node->init)
+            gen_expr(node->init);
+        if (node->cond)
+            gen_cond(node->cond, body, end);
+        start_block(body);
+        loop_depth++;
+        gen_stmt(node->lhs);
+        if (node->inc)
+            gen_expr(node->inc);
+        if (node->cond)
+            gen_cond(node->cond, body, end);
+        else
+            gen_jmp(body);
+        loop_depth--;
+        start_block(end);
+        return;
+    }
+    case ND_BLOCK:
+        for (NDList *cur = node->block; cur->node; cur = cur->next)
+            gen_stmt(cur->node);
+        return;
+    }
+}
+
+static int gen_expr(Node *node) {
+    switch (node->kind) {
+    case ND_NUM: {
+        IR *ir = new_ir(IR_IMM, 0, 0);
+        ir->imm = node->val;
+        ir->dst = new_vreg();
+        return ir->dst;
+    }
+    case ND_LVAR: {
+        IR *ir = new_ir(IR_LOAD, 0, 0);
+        ir->var = node->var;
+        count_use(node->var);
+        ir->dst = new_vreg();
+        return ir->dst;
+    }
+    case ND_ASSIGN: {
+        if (node->lhs->kind != ND_LVAR)
+            error("代入の左辺値が変数ではありません");
+        int val = gen_expr(node->rhs);
+        new_ir(IR_STORE, val, 0)->var = node->lhs->var;
+        count_use(node->lhs->var);
+        return val;
+    }
+    case ND_NEG:
+        return new_value(IR_NEG, gen_expr(node->lhs), 0);
+    case ND_CALL: {
+        int args = gen_args(node);
+        IR *ir = new_ir(IR_CALL, 0, 0);
+        ir->name = node->str;
+        ir->len = node->len;
+        ir->args = args;
+        ir->num_args = node->num_args;
+        ir->dst = new_vreg();
+        return ir->dst;
+    }
+    }
+
+    // 必要なレジスタが多い方から先に評価すると、同時に生きている値が少なくて済む
+    if (need_regs(node->rhs) > need_regs(node->lhs)) {
+        int rhs = gen_expr(node->rhs);
+        int lhs = gen_expr(node->lhs);
+        return new_value(binop[node->kind], lhs, rhs);
+    }
+    int lhs = gen_expr(node->lhs);
+    int rhs = gen_expr(node->rhs);
+    return new_value(binop[node->kind], lhs, rhs);
+}
+
+// 関数の文をIRにして、検査してから不要な命令を消す
+// 以降のパスはlocalsをこの関数の変数として使う
+void lower(Function *f) {
+    fn = f;
+    locals = fn->locals;
+    for (LVar *var = locals; var->offset; var = var->next)
+        var->uses = 0;
+    loop_depth = 0;
+    reset_ir();
+    // 自分自身の末尾呼び出しはブロック0に戻る
+    start_block(new_block());
+
+    result = new_vreg();
+    new_ir(IR_IMM, 0, 0)->dst = result;
+
+    for (int i = 0; fn->code[i]; i++)
+        gen_stmt(fn->code[i]);
+    new_ir(IR_RET, result, 0);
+
+    // 検査で解析した結果をそのまま最適化に使う
+    verify_ir();
+    eliminate_dead_code();
+    verify_ir();
+}
@@ -1,42 +1,358 @@
 #include "9cc.h"
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 
-// グローバル変数 tokenの定義
-Token *token;
+static bool peephole_stats;
+static bool arena_stats;
+static bool object;
+static bool run;
+static bool batch;
+static bool ir_dump;
+static bool no_fold;
+
+// 1つのプログラムを命令列にする
+static void compile(char *path, char *user_input) {
+    // トークナイズする
+    begin_phase(PHASE_TOKENIZE);
+    token = tokenize(path, user_input);
+    end_phase(PHASE_TOKENIZE);
+
+    // コードの抽象構文木はグローバル変数codeに格納
+    begin_phase(PHASE_PARSE);
+    program();
+    // 構文木ができたらトークンはいらない
+    // バッチでは次のプログラムでチャンクを使い回す
+    if (!batch)
+        arena_free(&token_arena);
+    end_phase(PHASE_PARSE);
+
+    // 定数式を畳み込んでおく
+    begin_phase(PHASE_FOLD);
+    if (!no_fold)
+        fold();
+    end_phase(PHASE_FOLD);
+
+    // 関数ごとにIRにしてから命令列を作り、冗長な部分を削ってから出力する
+    for (Function *fn = functions; fn; fn = fn->next) {
+        begin_phase(PHASE_LOWER);
+        lower(fn);
+        end_phase(PHASE_LOWER);
+        if (ir_dump) {
+            dump_ir(fn);
+            continue;
+        }
+
+        begin_phase(PHASE_CODEGEN);
+        codegen(fn);
+        end_phase(PHASE_CODEGEN);
+    }
+    if (ir_dump)
+        return;
+
+    begin_phase(PHASE_PEEPHOLE);
+    peephole();
+    end_phase(PHASE_PEEPHOLE);
+
+    if (peephole_stats)
+        print_peephole_stats();
+    if (arena_stats)
+        print_arena_stats();
+}
+
+// 命令列を標準出力に書き出す。--runなら実行してmainの返り値を返す
+static long finish() {
+    begin_phase(PHASE_EMIT);
+    if (run || object)
+        encode();
+    if (object)
+        write_elf();
+    else if (!run)
+        print_asm();
+    end_phase(PHASE_EMIT);
+
+    return run ? run_jit() : 0;
+}
+
+// 前のプログラムのトークン, 構文木, 変数を捨てる
+// チャンクは解放せずに使い回す
+static void reset_arenas() {
+    arena_reset(&token_arena);
+    arena_reset(&ast_arena);
+    arena_reset(&symbol_arena);
+}
+
+static void redirect_stdout(char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+        error("%s: %s", path, strerror(errno));
+    close(fd);
+}
+
+// foo/bar.c -> foo/bar.s (-cなら.o)
+static char *output_path(char *path) {
+    char *slash = strrchr(path, '/');
+    char *dot = strrchr(path, '.');
+    size_t len = dot && (!slash || dot > slash) ? dot - path : strlen(path);
+    char *out = malloc(len + 3);
+    memcpy(out, path, len);
+    strcpy(out + len, object ? ".o" : ".s");
+    return out;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void print_throughput(int units, int failed, double start) {
+    double elapsed = now() - start;
+    fprintf(stderr, "batch: %d units in %.3f s (%.0f units/s)\n",
+            units, elapsed, units / elapsed);
+    if (failed)
+        fprintf(stderr, "batch: %d of %d units failed\n", failed, units);
+}
+
+// バッチでエラーになったプログラムを、名前を付けて報告する
+// 途中のフェーズを閉じ、出力先を元の標準出力に戻す
+static void report_error(char *name, int saved_stdout) {
+    close_phases();
+    fflush(stdout);
+    if (saved_stdout >= 0)
+        dup2(saved_stdout, STDOUT_FILENO);
+    fprintf(stderr, "%s: コンパイルできません\n%s\n", name, error_message);
+}
+
+// マニフェストの1行に1つずつ書かれたソースファイルをコンパイルする
+// 出力は拡張子を.sか.oに変えたファイルに書く
+// --runなら出力の代わりに「パス: 返り値」を標準出力に出す
+// エラーになったプログラムは報告して次へ進み、最後に失敗した数を返す
+static int run_manifest(char *manifest) {
+    FILE *fp = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin;
+    if (fp == NULL)
+        error("%s: %s", manifest, strerror(errno));
+
+    int saved_stdout = dup(STDOUT_FILENO);
+    int units = 0;
+    int failed = 0;
+    double start = now();
+    for (char *line; (line = read_record(fp, '\n'));) {
+        if (*line == '\0')
+            continue;
+        char *path = strdup(line);
+        char *out = output_path(path);
+        // エラーで戻ってきたときにも解放できるように、setjmpの後の代入を残す
+        char *volatile user_input = NULL;
+        reset_arenas();
+
+        jmp_buf jmp;
+        if (setjmp(jmp) == 0) {
+            error_jmp = &jmp;
+            begin_phase(PHASE_READ);
+            user_input = read_file(path);
+            end_phase(PHASE_READ);
+            compile(path, user_input);
+
+            if (run) {
+                long ret = finish();
+                fflush(stdout);
+                printf("%s: %d\n", path, (int)(ret & 0xff));
+            } else {
+                redirect_stdout(out);
+                finish();
+                dup2(saved_stdout, STDOUT_FILENO);
+            }
+        } else {
+            report_error(path, saved_stdout);
+            // 書きかけや前回の出力を残さない
+            if (run)
+                printf("%s: error\n", path);
+            else
+                unlink(out);
+            failed++;
+        }
+        error_jmp = NULL;
+
+        if (user_input)
+            free_file(user_input);
+        free(out);
+        free(path);
+        units++;
+    }
+    fflush(stdout);
+    if (fp != stdin)
+        fclose(fp);
+    close(saved_stdout);
+    print_throughput(units, failed, start);
+    return failed;
+}
+
+// 標準入力からNULで区切られたソースを読んで順にコンパイルする
+// 各出力の後ろにNULを書く。--runなら返り値を1行ずつ出す
+// エラーになったプログラムは空の出力(--runなら"error")にして次へ進み、最後に失敗した数を返す
+static int run_stream() {
+    if (object)
+        error("--batch0では-cは使えません");
+
+    int units = 0;
+    int failed = 0;
+    double start = now();
+    for (char *user_input; (user_input = read_record(stdin, '\0'));) {
+        reset_arenas();
+
+        jmp_buf jmp;
+        if (setjmp(jmp) == 0) {
+            error_jmp = &jmp;
+            compile("-", user_input);
+            if (run) {
+                long ret = finish();
+                fflush(stdout);
+                printf("%d\n", (int)(ret & 0xff));
+                fflush(stdout);
+            } else {
+                finish();
+                write_out("", 1);
+            }
+        } else {
+            char name[64];
+            snprintf(name, sizeof(name), "%d番目のプログラム", units + 1);
+            report_error(name, -1);
+            if (run) {
+                printf("error\n");
+                fflush(stdout);
+            } else {
+                write_out("", 1);
+            }
+            failed++;
+        }
+        error_jmp = NULL;
+        units++;
+    }
+    print_throughput(units, failed, start);
+    return failed;
+}
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        // argv[0]がコンパイラ、argv[1]が入力するコードに相当
-        fprintf(stderr, "引数の個数が正しくありません\n");
+    char *path = NULL;
+    bool show_stats = false;
+    char *stats_path = NULL;
+    char *output = NULL;
+    char *manifest = NULL;
+    bool stream = false;
+
+    for (int i = 1; i < argc; i++) {
+        // 規則ごとに消した命令数を標準エラーに出す
+        if (!strcmp(argv[i], "--peephole-stats")) {
+            peephole_stats = true;
+            continue;
+        }
+        // アリーナごとの確保数とバイト数を標準エラーに出す
+        if (!strcmp(argv[i], "--arena-stats")) {
+            arena_stats = true;
+            continue;
+        }
+        // フェーズごとの時間やオブジェクトの数などを標準エラーに出す
+        // --stats=FILE ならJSONでFILEに書く
+        if (!strcmp(argv[i], "--stats")) {
+            show_stats = true;
+            continue;
+        }
+        if (!strncmp(argv[i], "--stats=", 8)) {
+            show_stats = true;
+            stats_path = argv[i] + 8;
+            continue;
+        }
+        // トークナイザのスキャナを選ぶ(scalar, sse2, avx2)
+        if (!strncmp(argv[i], "--scanner=", 10)) {
+            select_scanner(argv[i] + 10);
+            continue;
+        }
+        // 出力するアセンブリからコメント行を省く
+        if (!strcmp(argv[i], "--no-comments")) {
+            asm_comments = false;
+            continue;
+        }
+        // 定数の畳み込みをせずに、後ろのパスをそのまま試す
+        if (!strcmp(argv[i], "--no-fold")) {
+            no_fold = true;
+            continue;
+        }
+        // アセンブリの代わりにIRを出力する
+        if (!strcmp(argv[i], "--dump-ir")) {
+            ir_dump = true;
+            continue;
+        }
+        // アセンブリの代わりにELFのオブジェクトファイルを出力する
+        if (!strcmp(argv[i], "-c")) {
+            object = true;
+            continue;
+        }
+        // 出力せずにその場で実行し、mainの返り値を終了ステータスにする
+        if (!strcmp(argv[i], "--run")) {
+            run = true;
+            continue;
+        }
+        // --runで呼ぶ関数を探す共有ライブラリ
+        if (!strncmp(argv[i], "--load=", 7)) {
+            load_library(argv[i] + 7);
+            continue;
+        }
+        // 標準出力の代わりにファイルに書く
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+            continue;
+        }
+        // 1つのプロセスで複数のプログラムをコンパイルする
+        // --batch=FILE はFILE("-"なら標準入力)に1行に1つ書かれたソースファイルを、
+        // --batch0 は標準入力からNULで区切られたソースを読む
+        if (!strncmp(argv[i], "--batch=", 8)) {
+            batch = true;
+            manifest = argv[i] + 8;
+            continue;
+        }
+        if (!strcmp(argv[i], "--batch0")) {
+            batch = true;
+            stream = true;
+            continue;
+        }
+        if (path) {
+            path = NULL;
+            break;
+        }
+        path = argv[i];
+    }
+
+    if (batch ? path != NULL : path == NULL) {
+        // 入力はファイル名で渡す。"-"なら標準入力から読む
+        fprintf(stderr, "usage: 9cc [options] [-c] [-o <output>] <file|->\n"
+                        "       9cc [options] [-c] --batch=<manifest>\n"
+                        "       9cc [options] --batch0\n");
         return 1;
     }
 
-    // トークナイズする
-    token = tokenize(argv[1]);
-    // コードの抽象構文木はグローバル変数codeに格納
-    program();
+    if (output)
+        redirect_stdout(output);
+    if (batch && ir_dump)
+        error("--dump-irは1つのファイルにしか使えません");
 
-    // アセンブリの前半部分を出力
-    printf(".intel_syntax noprefix\n");
-    printf(".globl main\n");
-    printf("main:\n");
-
-    // プロローグ
-    // 変数個分の領域を確保する
-    printf("    # prologue\n");
-    printf("    push rbp\n");
-    printf("    mov rbp, rsp\n");
-    printf("    sub rsp, %d\n", locals->offset);
-
-    // 先頭の式から順にコード生成
-    for (int i = 0; code[i]; i++) {
-        gen_stmt(code[i]);
+    if (batch) {
+        int failed = stream ? run_stream() : run_manifest(manifest);
+        if (show_stats)
+            print_stats(stats_path);
+        return failed ? 1 : 0;
     }
 
-    // エピローグ
-    // 最後の式の結果がRAXに残っているのでそれが返り値になる
-    printf("    # epilogue\n");
-    printf("    mov rsp, rbp\n");
-    printf("    pop rbp\n");
-    printf("    ret\n");
-    return 0;
+    begin_phase(PHASE_READ);
+    char *user_input = read_file(path);
+    end_phase(PHASE_READ);
+
+    compile(path, user_input);
+    if (ir_dump)
+        return 0;
+    long ret = finish();
+
+    if (show_stats)
+        print_stats(stats_path);
+    return ret;
 }
@@ -0,0 +1,116 @@
+#include "9cc.h"
+#include "ninecc.h"
+
+//
+// libnineccの実装
+// 各パスをそのまま呼び、エラーはsetjmpで受け取り、出力はsinkで受け取る
+//
+
+// スキャナはNULの後ろまで読むので、余白を付けた写しを作る
+#define PADDING 32
+
+static _Thread_local char *input;
+static _Thread_local size_t input_cap;
+
+static char *copy_input(const char *src) {
+    size_t len = strlen(src);
+    if (len + PADDING > input_cap) {
+        input_cap = (len + PADDING) * 2;
+        input = realloc(input, input_cap);
+        if (input == NULL)
+            error("メモリを確保できません");
+    }
+    memcpy(input, src, len);
+    memset(input + len, 0, PADDING);
+    return input;
+}
+
+struct Compiler {
+    int format;
+    bool comments;
+    char error[ERROR_MAX];
+};
+
+Compiler *ninecc_new() {
+    Compiler *c = calloc(1, sizeof(Compiler));
+    if (c == NULL)
+        return NULL;
+    c->format = NINECC_ASM;
+    c->comments = true;
+    return c;
+}
+
+void ninecc_free(Compiler *c) {
+    free(c);
+}
+
+void ninecc_set_format(Compiler *c, int format) {
+    c->format = format;
+}
+
+void ninecc_set_comments(Compiler *c, int comments) {
+    c->comments = comments;
+}
+
+const char *ninecc_error(Compiler *c) {
+    return c->error;
+}
+
+long ninecc_compile(Compiler *c, const char *name, const char *src, char *out, size_t cap) {
+    Sink s = {out, cap, 0};
+    jmp_buf jmp;
+
+    arena_reset(&token_arena);
+    arena_reset(&ast_arena);
+    arena_reset(&symbol_arena);
+    c->error[0] = '\0';
+
+    if (setjmp(jmp)) {
+        error_jmp = NULL;
+        sink = NULL;
+        strcpy(c->error, error_message);
+        return -1;
+    }
+    error_jmp = &jmp;
+    sink = &s;
+    asm_comments = c->comments;
+
+    token = tokenize((char *)name, copy_input(src));
+    program();
+    fold();
+    for (Function *fn = functions; fn; fn = fn->next) {
+        lower(fn);
+        codegen(fn);
+    }
+    peephole();
+    if (c->format == NINECC_OBJECT) {
+        encode();
+        write_elf();
+    } else {
+        print_asm();
+    }
+
+    error_jmp = NULL;
+    sink = NULL;
+    return s.len;
+}
+
+void ninecc_thread_cleanup(void) {
+    free(input);
+    input = NULL;
+    input_cap = 0;
+    arena_free(&token_arena);
+    arena_free(&ast_arena);
+    arena_free(&symbol_arena);
+    free_parser();
+    free_symtab();
+    free_asm();
+    free_peephole();
+    free_emit();
+    free_encode();
+    free_elf();
+    free_ir();
+    free_regalloc();
+    free_codegen();
+    free_isel();
+}
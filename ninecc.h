@@ -0,0 +1,41 @@
+#ifndef NINECC_H
+#define NINECC_H
+
+#include <stddef.h>
+
+//
+// 9ccをライブラリとして使うためのインターフェース
+//
+// Compilerはオプションとエラーメッセージを持つ。コンパイラの作業用の状態は
+// スレッドごとにあるので、別々のスレッドでそれぞれのCompilerを使えば
+// 同時にコンパイルできる。1つのCompilerを複数のスレッドで同時に使ってはいけない。
+//
+// スレッドごとの作業領域は次のコンパイルで使い回す。スレッドが終わっても
+// 自動では解放されないので、終わる前にninecc_thread_cleanupを呼ぶこと。
+//
+
+typedef struct Compiler Compiler;
+
+// 出力の形式
+enum {
+    NINECC_ASM,     // Intel記法のアセンブリ
+    NINECC_OBJECT,  // ELF64の再配置可能なオブジェクトファイル
+};
+
+Compiler *ninecc_new(void);
+void ninecc_free(Compiler *c);
+void ninecc_set_format(Compiler *c, int format);
+void ninecc_set_comments(Compiler *c, int comments);
+
+// NUL終端されたsrcをコンパイルしてoutに書く
+// 出力の全体の長さを返す。capより長ければcapバイトで切られているので、
+// 大きなバッファでやり直す。outはNUL終端しない。
+// エラーなら-1を返し、メッセージはninecc_errorで取れる。nameはメッセージに使う。
+long ninecc_compile(Compiler *c, const char *name, const char *src, char *out, size_t cap);
+const char *ninecc_error(Compiler *c);
+
+// 呼んだスレッドの作業領域を解放する。スレッドを終える前に呼ぶ
+// その後にまたコンパイルしてもよい(作業領域は作り直される)
+void ninecc_thread_cleanup(void);
+
+#endif
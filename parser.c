@@ -4,8 +4,9 @@
 // grammer
 //
 
-// program = function*
-// function = ident "(" args ")" "{" stmt* "}"
+// program = (function | stmt)*
+// function = ident "(" params? ")" "{" stmt* "}"
+// params     = ident ("," ident)*
 // stmt       = expr_stmt 
         // | "{" stmt* "}"
         // | "if" "(" expr ")" stmt ("else" stmt)?
@@ -25,16 +26,39 @@
 //              | "(" expr ")"
 // args       = expr ("," expr)*
 
-LVar *locals;
+// 現在着目しているトークン
+_Thread_local Token *token;
 
-Node *code[100];
+_Thread_local LVar *locals;
+
+_Thread_local Function *functions;
+
+// 文の数に応じて倍々に伸ばす
+_Thread_local Node **code;
+static _Thread_local int code_capacity;
+
+static void add_code(int i, Node *node) {
+    if (i == code_capacity) {
+        code_capacity = code_capacity ? code_capacity * 2 : 256;
+        code = realloc(code, sizeof(Node *) * code_capacity);
+        if (code == NULL)
+            error("メモリを確保できません");
+    }
+    code[i] = node;
+}
 
 Node *new_node(NodeKind kind) {
-    Node *node = calloc(1, sizeof(Node)); // callocはメモリの確保と0で初期化。mallocは初期化がない。
+    Node *node = arena_alloc(&ast_arena, sizeof(Node)); // 0で初期化された領域が返る
     node->kind = kind;
+    stats.nodes++;
     return node;
 }
 
+NDList *new_ndlist() {
+    stats.ndlists++;
+    return arena_alloc(&ast_arena, sizeof(NDList));
+}
+
 Node *new_binary(NodeKind kind, Node *lhs, Node *rhs) {
     Node *node = new_node(kind);
     node->lhs = lhs;
@@ -42,7 +66,7 @@ Node *new_binary(NodeKind kind, Node *lhs, Node *rhs) {
     return node;
 }
 
-Node *new_num(int val) {
+Node *new_num(long val) {
     Node *node = new_node(ND_NUM);
     node->val = val;
     return node;
@@ -50,12 +74,14 @@ Node *new_num(int val) {
 
 // local variable
 LVar *new_lvar(char *name, int len) {
-    LVar *lvar = calloc(1, sizeof(LVar));
+    LVar *lvar = arena_alloc(&symbol_arena, sizeof(LVar));
     lvar->name = name;
     lvar->len = len;
     lvar->offset = locals->offset + 8;
     lvar->next = locals;
     locals = lvar;
+    declare_lvar(lvar);
+    stats.lvars++;
     return lvar;
 }
 
@@ -100,10 +126,10 @@ void expect(char *op) {
 
 // 次のトークンが数値の場合、トークンを1つ読み進めてその数値を返す。
 // それ以外の場合にはエラーを報告する。
-int expect_number() {
+long expect_number() {
     if (token->kind != TK_NUM)
         error_at(token->str, "数ではありません。");
-    int val = token->val;
+    long val = token->val;
     token = token->next;
     return val;
 }
@@ -119,15 +145,10 @@ bool at_eof() {
     return token->kind == TK_EOF;
 }
 
-// 変数を名前で検索する。見つからなかった場合はNULLを返す。
-LVar *find_lvar(Token *tok) {
-    for (LVar *var = locals; var; var = var->next)
-        if (var->len == tok->len && !memcmp(tok->str, var->name, var->len))
-            return var;
-    return NULL;
+static bool equal(Token *tok, char *op) {
+    return tok->kind == TK_RESERVED && strlen(op) == tok->len && !memcmp(tok->str, op, tok->len);
 }
 
-
 //////////////////////////////////
 // AST grammers
 //////////////////////////////////
@@ -145,35 +166,104 @@ Node *mul();
 Node *unary();
 Node *primary();
 
+// ident "(" (ident ("," ident)*)? ")" "{" と続けば関数定義
+// 関数の外の文の関数呼び出しとはここで区別する
+static bool is_function() {
+    if (token->kind != TK_IDENT || !equal(token->next, "("))
+        return false;
+    Token *tok = token->next->next;
+    while (tok->kind == TK_IDENT || equal(tok, ","))
+        tok = tok->next;
+    return equal(tok, ")") && equal(tok->next, "{");
+}
+
+static Function *find_function(char *name, int len) {
+    for (Function *fn = functions; fn; fn = fn->next)
+        if (fn->len == len && !memcmp(fn->name, name, len))
+            return fn;
+    return NULL;
+}
+
+static Function *new_function(char *name, int len) {
+    if (find_function(name, len))
+        error_at(name, "関数%.*sはすでに定義されています", len, name);
+    Function *fn = arena_alloc(&ast_arena, sizeof(Function));
+    fn->name = name;
+    fn->len = len;
+    return fn;
+}
+
+static Function *function() {
+    Token *tok = consume_ident();
+    Function *fn = new_function(tok->str, tok->len);
+
+    // 変数は関数ごとに別に持つ
+    LVar *outer = locals;
+    locals = arena_alloc(&symbol_arena, sizeof(LVar));
+    enter_function_scope();
+
+    expect("(");
+    if (consume(")") == false) {
+        do {
+            Token *param = consume_ident();
+            if (param == NULL)
+                error_at(token->str, "引数の名前ではありません");
+            if (find_lvar(param))
+                error_at(param->str, "引数%.*sが重複しています", param->len, param->str);
+            new_lvar(param->str, param->len);
+            fn->num_params++;
+        } while (consume(","));
+        expect(")");
+    }
+    // 変数のリストは宣言の逆順に並んでいる
+    fn->params = arena_alloc(&symbol_arena, sizeof(LVar *) * fn->num_params);
+    LVar *var = locals;
+    for (int i = fn->num_params - 1; i >= 0; i--, var = var->next)
+        fn->params[i] = var;
+
+    fn->code = arena_alloc(&ast_arena, sizeof(Node *) * 2);
+    fn->code[0] = stmt();
+    leave_scope();
+
+    fn->locals = locals;
+    locals = outer;
+    return fn;
+}
+
 void program() {
-    // Node *node;
-    // Token *tok_fname = consume_ident();
-    // node = new_node(ND_FUNCTION);
-    // node->str = tok_fname->str;
-    // node->len = tok_fname->len;
-
-    // expect("(");
-    // if (consume(")") == false) {
-    //     while (true) {
-    //         Token *tok_ident = consume_ident();
-    //         new_lvar(tok_ident->str, tok_ident->len);
-    //         if (consume(",") == false)
-    //             break;
-    //     }
-    //     expect(")");
-    // }
-    // expect("{");
-
-    LVar head;
-    head.next = NULL;
-    head.offset = 0;
-    locals = &head;
+    reset_symtab();
+    functions = NULL;
+    Function **tail = &functions;
+
+    // 番兵。offsetが確保する領域の大きさになる
+    locals = arena_alloc(&symbol_arena, sizeof(LVar));
+    enter_scope();
 
     int i = 0;
+    char *main_loc = NULL;
     while (!at_eof()) {
-        code[i++] = stmt();
+        if (is_function()) {
+            *tail = function();
+            tail = &(*tail)->next;
+            continue;
+        }
+        if (!main_loc)
+            main_loc = token->str;
+        add_code(i++, stmt());
+    }
+    add_code(i, NULL);
+    leave_scope();
+
+    // 関数の外の文はmainにまとめる
+    // 文がなくてmainを定義していれば、それをそのまま使う
+    if (i > 0 || !find_function("main", 4)) {
+        if (find_function("main", 4))
+            error_at(main_loc, "mainの定義と関数の外の文は一緒に使えません");
+        Function *fn = new_function("main", 4);
+        fn->locals = locals;
+        fn->code = code;
+        *tail = fn;
     }
-    code[i] = NULL;
 }
 
 Node *stmt() {
@@ -226,11 +316,11 @@ Node *stmt() {
     // block
     if (consume("{")) {
         node = new_node(ND_BLOCK);
-        NDList *head = calloc(1, sizeof(NDList));
+        NDList *head = new_ndlist();
         NDList *cur = head;
         while (consume("}") == false) {
             cur->node = stmt();
-            cur->next = calloc(1, sizeof(NDList));
+            cur->next = new_ndlist();
             cur = cur->next;
         } 
         node->block = head;
@@ -344,12 +434,12 @@ Node *primary() {
             int num_args = 0;
             // 引数(arguments)ありの場合
             if (consume(")") == false) {
-                NDList *head = calloc(1, sizeof(NDList));
+                NDList *head = new_ndlist();
                 NDList *arg = head;
                 arg->node = expr();
                 num_args++;
                 while (consume(",")) {
-                    arg->next = calloc(1, sizeof(NDList));
+                    arg->next = new_ndlist();
                     arg = arg->next;
                     arg->node = expr();
                     num_args++;
@@ -368,6 +458,7 @@ Node *primary() {
                 lvar = new_lvar(tok_ident->str, tok_ident->len);
             }
             node->offset = lvar->offset;
+            node->var = lvar;
             return node;
         }
 
@@ -377,3 +468,10 @@ Node *primary() {
     return new_num(expect_number());
 }
 
+
+// スレッドの作業領域を解放する
+void free_parser() {
+    free(code);
+    code = NULL;
+    code_capacity = 0;
+}
@@ -0,0 +1,379 @@
+#include "9cc.h"
+
+//
+// peephole最適化
+// codegenが作った命令列を前から眺めて、冗長な命令の並びを書き換える
+//
+
+#define BIT(r) (1u << (r))
+#define ARG_REGS (BIT(RDI) | BIT(RSI) | BIT(RDX) | BIT(RCX) | BIT(R8) | BIT(R9))
+#define CALLER_SAVED (BIT(RAX) | ARG_REGS | BIT(R10) | BIT(R11))
+#define CALLEE_SAVED (BIT(RBX) | BIT(RSP) | BIT(RBP) | BIT(R12) | BIT(R13) | BIT(R14) | BIT(R15))
+
+// 各命令の直後で生きているレジスタの集合
+static _Thread_local unsigned *live_out;
+static _Thread_local unsigned *live_in;
+
+//
+// 生存解析
+//
+
+static unsigned operand_use(Operand *op) {
+    if (op->kind == OPD_MEM)
+        return BIT(op->reg) | (op->scale ? BIT(op->index) : 0);
+    return 0;
+}
+
+// 命令が読むレジスタと書くレジスタ
+static void use_def(Insn *insn, unsigned *use, unsigned *def) {
+    unsigned dst = insn->dst.kind == OPD_REG ? BIT(insn->dst.reg) : 0;
+    unsigned src = insn->src.kind == OPD_REG ? BIT(insn->src.reg) : 0;
+    *use = operand_use(&insn->dst) | operand_use(&insn->src) | src;
+    *def = 0;
+
+    switch (insn->op) {
+    case I_MOV:
+    case I_LEA:
+    case I_MOVZB:
+        *def = dst;
+        return;
+    case I_POP:
+        *def = dst | BIT(RSP);
+        *use |= BIT(RSP);
+        return;
+    case I_PUSH:
+        *use |= dst | BIT(RSP);
+        *def = BIT(RSP);
+        return;
+    case I_ADD:
+    case I_SUB:
+    case I_IMUL:
+    case I_AND:
+    case I_NEG:
+    case I_SHL:
+    case I_SHR:
+    case I_SAR:
+        *use |= dst;
+        *def = dst;
+        return;
+    case I_CMP:
+        *use |= dst;
+        return;
+    case I_CQO:
+        *use |= BIT(RAX);
+        *def = BIT(RDX);
+        return;
+    case I_IMUL1:
+        *use |= dst | BIT(RAX);
+        *def = BIT(RAX) | BIT(RDX);
+        return;
+    case I_IDIV:
+        *use |= dst | BIT(RAX) | BIT(RDX);
+        *def = BIT(RAX) | BIT(RDX);
+        return;
+    case I_SETE:
+    case I_SETNE:
+    case I_SETL:
+    case I_SETLE:
+    case I_SETG:
+    case I_SETGE:
+        // alだけを書き換えるので残りのビットは読んだことにする
+        *use |= dst;
+        *def = dst;
+        return;
+    case I_CALL:
+        *use |= ARG_REGS | BIT(RAX) | BIT(RSP);
+        *def = CALLER_SAVED;
+        return;
+    case I_JMP:
+        // 関数への末尾呼び出しは、呼び出しと戻りを合わせたもの
+        if (insn->dst.kind == OPD_SYM)
+            *use |= ARG_REGS | BIT(RAX) | CALLEE_SAVED;
+        return;
+    case I_RET:
+        *use |= BIT(RAX) | CALLEE_SAVED;
+        return;
+    }
+}
+
+static unsigned live_at_label(Operand *label) {
+    int pos = find_label(label);
+    return pos < 0 ? 0 : live_in[pos];
+}
+
+// 命令列を後ろから辿って、変化がなくなるまで生存区間を伸ばす
+static void compute_liveness() {
+    live_out = realloc(live_out, sizeof(unsigned) * num_insns);
+    live_in = realloc(live_in, sizeof(unsigned) * num_insns);
+    memset(live_in, 0, sizeof(unsigned) * num_insns);
+    index_labels();
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = num_insns - 1; i >= 0; i--) {
+            Insn *insn = &insns[i];
+            unsigned out = 0;
+            switch (insn->op) {
+            case I_JMP:
+                if (insn->dst.kind == OPD_LABEL)
+                    out = live_at_label(&insn->dst);
+                break;
+            case I_JE:
+            case I_JNE:
+            case I_JL:
+            case I_JLE:
+            case I_JG:
+            case I_JGE:
+                out = live_at_label(&insn->dst);
+                if (i + 1 < num_insns)
+                    out |= live_in[i + 1];
+                break;
+            case I_RET:
+                break;
+            default:
+                if (i + 1 < num_insns)
+                    out = live_in[i + 1];
+                break;
+            }
+
+            unsigned use, def;
+            use_def(insn, &use, &def);
+            unsigned in = use | (out & ~def);
+            live_out[i] = out;
+            if (in != live_in[i]) {
+                live_in[i] = in;
+                changed = true;
+            }
+        }
+    }
+}
+
+//
+// 書き換え規則
+// どの規則も、先頭の命令を消して2つ目の命令を書き換える
+// 生存情報は2つ目の命令の位置についてのものがそのまま使える
+//
+
+// コメントと消された命令を飛ばして次の命令の位置を返す
+static int next_insn(int i) {
+    for (i++; i < num_insns; i++)
+        if (insns[i].op != I_COMMENT && insns[i].op != I_NOP)
+            return i;
+    return -1;
+}
+
+static bool is_reg(Operand *op, Reg reg) {
+    return op->kind == OPD_REG && op->reg == reg;
+}
+
+static bool is_imm32(Operand *op) {
+    return op->kind == OPD_IMM && op->val == (int)op->val;
+}
+
+static bool is_live(int i, Reg reg) {
+    return live_out[i] & BIT(reg);
+}
+
+// push X; pop Y => mov Y, X
+static int push_pop(int i) {
+    int j = next_insn(i);
+    if (insns[i].op != I_PUSH || j < 0 || insns[j].op != I_POP)
+        return 0;
+
+    Operand *x = &insns[i].dst;
+    Operand *y = &insns[j].dst;
+    if (is_reg(y, RSP) || (x->kind == OPD_MEM && x->reg == RSP))
+        return 0;
+
+    insns[i].op = I_NOP;
+    if (x->kind == OPD_REG && x->reg == y->reg) {
+        insns[j].op = I_NOP;
+        return 2;
+    }
+    insns[j].op = I_MOV;
+    insns[j].src = *x;
+    return 1;
+}
+
+// lea r, [m]; op ..., [r+d] => op ..., [m+d]
+static int fold_lea(int i) {
+    int j = next_insn(i);
+    if (insns[i].op != I_LEA || j < 0 || insns[i].src.scale)
+        return 0;
+
+    Reg r = insns[i].dst.reg;
+    Insn *next = &insns[j];
+    Operand *mem;
+    if (next->dst.kind == OPD_MEM && next->dst.reg == r && !is_reg(&next->src, r))
+        mem = &next->dst;
+    else if (next->src.kind == OPD_MEM && next->src.reg == r && next->dst.kind == OPD_REG &&
+             (next->op == I_MOV || next->dst.reg != r))
+        mem = &next->src;
+    else
+        return 0;
+    if (mem->scale)
+        return 0;
+
+    // rの値が後で使われるなら消せない
+    // mov r, [r] のようにrを上書きする場合は問題ない
+    if (is_live(j, r) && !(next->op == I_MOV && is_reg(&next->dst, r)))
+        return 0;
+
+    mem->reg = insns[i].src.reg;
+    mem->val += insns[i].src.val;
+    insns[i].op = I_NOP;
+    return 1;
+}
+
+// mov a, X; mov b, a => mov b, X
+// mov a, X; push a   => push X
+// mov a, X; mov [m], a => mov [m], X
+static int forward_copy(int i) {
+    int j = next_insn(i);
+    if ((insns[i].op != I_MOV && insns[i].op != I_LEA) || j < 0)
+        return 0;
+    if (insns[i].dst.kind != OPD_REG)
+        return 0;
+
+    Reg a = insns[i].dst.reg;
+    Operand *x = &insns[i].src;
+    Insn *next = &insns[j];
+    // 次の命令がaを上書きするなら、その後でaが生きていてもよい
+    // pushのオペランドは読むだけなので上書きではない
+    if (is_live(j, a) && !(next->op == I_MOV && is_reg(&next->dst, a)))
+        return 0;
+
+    switch (next->op) {
+    case I_MOV:
+        if (!is_reg(&next->src, a) || operand_use(&next->dst) & BIT(a))
+            return 0;
+        if (next->dst.kind == OPD_MEM && (insns[i].op == I_LEA || !(x->kind == OPD_REG || is_imm32(x))))
+            return 0;
+        if (next->dst.kind == OPD_REG)
+            next->op = insns[i].op;
+        next->src = *x;
+        break;
+    case I_PUSH:
+        if (insns[i].op != I_MOV || !is_reg(&next->dst, a))
+            return 0;
+        if (!(x->kind == OPD_REG || x->kind == OPD_MEM || is_imm32(x)))
+            return 0;
+        if (x->kind == OPD_MEM && x->reg == RSP)
+            return 0;
+        next->dst = *x;
+        break;
+    default:
+        return 0;
+    }
+    insns[i].op = I_NOP;
+    return 1;
+}
+
+// 結果が使われないmov => 削除
+static int dead_move(int i) {
+    Insn *insn = &insns[i];
+    if (insn->op != I_MOV && insn->op != I_LEA && insn->op != I_MOVZB)
+        return 0;
+    if (insn->dst.kind != OPD_REG)
+        return 0;
+    Reg r = insn->dst.reg;
+    if (r == RSP || r == RBP || is_live(i, r))
+        return 0;
+    insn->op = I_NOP;
+    return 1;
+}
+
+// mov r, r => 削除
+static int self_move(int i) {
+    Insn *insn = &insns[i];
+    if (insn->op != I_MOV || insn->dst.kind != OPD_REG || !is_reg(&insn->src, insn->dst.reg))
+        return 0;
+    insn->op = I_NOP;
+    return 1;
+}
+
+// jmp .L; .L: => .L:
+static int jump_to_next(int i) {
+    int j = next_insn(i);
+    if (insns[i].op != I_JMP || j < 0 || insns[j].op != I_LABEL)
+        return 0;
+    Operand *target = &insns[i].dst;
+    Operand *label = &insns[j].dst;
+    if (label->kind != OPD_LABEL || target->val != label->val || strcmp(target->str, label->str))
+        return 0;
+    insns[i].op = I_NOP;
+    return 1;
+}
+
+typedef struct {
+    char *name;
+    int (*apply)(int i);    // insns[i]から始まる並びを書き換えて、消した命令数を返す
+    int removed;
+} Rule;
+
+static _Thread_local Rule rules[] = {
+    {"self-move", self_move},
+    {"push-pop", push_pop},
+    {"fold-lea", fold_lea},
+    {"forward-copy", forward_copy},
+    {"dead-move", dead_move},
+    {"jump-to-next", jump_to_next},
+    {NULL},
+};
+
+static _Thread_local int insns_before;
+
+// 統計はこの呼び出しで書き換えた分だけを数える
+void peephole() {
+    insns_before = 0;
+    for (Rule *rule = rules; rule->name; rule++)
+        rule->removed = 0;
+    for (int i = 0; i < num_insns; i++)
+        if (insns[i].op != I_COMMENT)
+            insns_before++;
+
+    // 書き換えで消えた命令の分だけ生存区間が縮むので、変化がなくなるまで繰り返す
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        compute_liveness();
+        for (int i = 0; i < num_insns; i++) {
+            if (insns[i].op == I_NOP || insns[i].op == I_COMMENT)
+                continue;
+            for (Rule *rule = rules; rule->name; rule++) {
+                int n = rule->apply(i);
+                if (n) {
+                    rule->removed += n;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    // 消した命令を詰める
+    int n = 0;
+    for (int i = 0; i < num_insns; i++)
+        if (insns[i].op != I_NOP)
+            insns[n++] = insns[i];
+    num_insns = n;
+}
+
+// 規則ごとに消した命令数を表示する
+void print_peephole_stats() {
+    int total = 0;
+    fprintf(stderr, "peephole:\n");
+    for (Rule *rule = rules; rule->name; rule++) {
+        fprintf(stderr, "  %-14s %8d\n", rule->name, rule->removed);
+        total += rule->removed;
+    }
+    fprintf(stderr, "  %-14s %8d / %d\n", "total", total, insns_before);
+}
+
+// スレッドの作業領域を解放する
+void free_peephole() {
+    free(live_out);
+    free(live_in);
+    live_out = live_in = NULL;
+}
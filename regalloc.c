@@ -0,0 +1,246 @@
+#include "9cc.h"
+
+//
+// 線形走査による仮想レジスタの割り当て
+//
+// 仮想レジスタの生存区間を、最初に現れる位置から最後に現れる位置までの
+// 1つの範囲で近似する。ブロックをまたいで生きるものは、生きているブロックの
+// 範囲まで広げる。区間を始まりの順に見て、空いているレジスタを割り当てる。
+// 空きがなければ、終わりが一番遠い区間をスタックに追い出す。
+//
+// 生存情報はlowerの最後のverify_irで求めたものを使う。
+// select_operandsで使う側に埋め込むと決めた仮想レジスタには割り当てない。
+//
+// 変数はアドレスを取られることがないので、よく使うものはpromote_varsで
+// callee-savedのレジスタに置く。呼び出しをまたいでも退避しなくてよい。
+//
+
+// 割り当てるレジスタ
+// raxとrdxはidivと返り値で、r11は追い出した値の受け皿として使うので含めない
+static Reg alloc_regs[] = {R10, RDI, RSI, RCX, R8, R9};
+#define NUM_REGS (int)(sizeof(alloc_regs) / sizeof(*alloc_regs))
+
+// 変数を置くレジスタ
+static Reg var_regs[] = {RBX, R12, R13, R14, R15};
+#define NUM_VAR_REGS (int)(sizeof(var_regs) / sizeof(*var_regs))
+
+// これより使われない変数は、レジスタの退避と復元の方が高くつく
+#define MIN_USES 3
+
+_Thread_local Operand *vreg_loc;
+_Thread_local int spill_size;
+_Thread_local unsigned saved_regs;
+_Thread_local int frame_size;
+
+static _Thread_local Operand *var_locs;    // offset/8で引く変数の置き場所
+static _Thread_local LVar **hot;
+
+static _Thread_local int *start;
+static _Thread_local int *end;
+static _Thread_local int *order;
+
+// レジスタを割り当て中の区間。終わりの早い順
+static _Thread_local int active[NUM_REGS];
+static _Thread_local int num_active;
+
+static void extend(int v, int pos) {
+    if (start[v] < 0 || pos < start[v])
+        start[v] = pos;
+    if (pos > end[v])
+        end[v] = pos;
+}
+
+static void build_intervals() {
+    start = realloc(start, sizeof(int) * (num_vregs + 1));
+    end = realloc(end, sizeof(int) * (num_vregs + 1));
+    if (start == NULL || end == NULL)
+        error("メモリを確保できません");
+    for (int v = 0; v <= num_vregs; v++)
+        start[v] = end[v] = -1;
+
+    for (int j = 0; j < num_irs; j++) {
+        IR *ir = &irs[j];
+        for (int k = 0; k < num_uses(ir); k++)
+            extend(ir_use(ir, k), j);
+        if (ir->dst)
+            extend(ir->dst, j);
+    }
+
+    // 入口で生きていればブロックの先頭から、出口で生きていれば終端命令の後まで
+    if (num_globals == 0)
+        return;
+    for (int v = 1; v <= num_vregs; v++) {
+        int g = vreg_global[v];
+        if (g < 0)
+            continue;
+        for (int b = 0; b < num_blocks; b++) {
+            if (blocks[b].start == blocks[b].end)
+                continue;
+            if (live_in_block(b, g))
+                extend(v, blocks[b].start);
+            if (live_out_block(b, g))
+                extend(v, blocks[b].end);
+        }
+    }
+}
+
+static int by_start(const void *x, const void *y) {
+    int a = *(int *)x, b = *(int *)y;
+    if (start[a] != start[b])
+        return start[a] < start[b] ? -1 : 1;
+    return a - b;
+}
+
+static void add_active(int v) {
+    int i = num_active++;
+    while (i > 0 && end[active[i - 1]] > end[v]) {
+        active[i] = active[i - 1];
+        i--;
+    }
+    active[i] = v;
+}
+
+// posまでに終わった区間のレジスタを空ける
+static void expire(int pos, unsigned *free_regs) {
+    int n = 0;
+    for (int i = 0; i < num_active; i++) {
+        int v = active[i];
+        if (end[v] <= pos)
+            *free_regs |= 1u << vreg_loc[v].reg;
+        else
+            active[n++] = v;
+    }
+    num_active = n;
+}
+
+static void spill(int v) {
+    spill_size += 8;
+    vreg_loc[v] = mem_op(RBP, -(frame_size + spill_size));
+}
+
+// 呼び出しをまたいで生きているレジスタ
+static unsigned live_regs() {
+    unsigned regs = 0;
+    for (int i = 0; i < num_active; i++)
+        regs |= 1u << vreg_loc[active[i]].reg;
+    return regs;
+}
+
+static int by_uses(const void *x, const void *y) {
+    LVar *a = *(LVar **)x, *b = *(LVar **)y;
+    if (a->uses != b->uses)
+        return a->uses > b->uses ? -1 : 1;
+    return a->offset - b->offset;
+}
+
+// 使われる回数の多い変数からレジスタに置き、残りをフレームに詰める
+// フレームは退避したレジスタのすぐ下から始まる
+void promote_vars() {
+    int num_vars = locals->offset / 8;
+    var_locs = realloc(var_locs, sizeof(Operand) * (num_vars + 1));
+    hot = realloc(hot, sizeof(LVar *) * (num_vars + 1));
+    if (var_locs == NULL || hot == NULL)
+        error("メモリを確保できません");
+
+    int n = 0;
+    for (LVar *var = locals; var->offset; var = var->next) {
+        var_locs[var->offset / 8] = (Operand){OPD_NONE};
+        if (var->uses >= MIN_USES)
+            hot[n++] = var;
+    }
+    qsort(hot, n, sizeof(LVar *), by_uses);
+
+    saved_regs = 0;
+    for (int i = 0; i < n && i < NUM_VAR_REGS; i++) {
+        var_locs[hot[i]->offset / 8] = reg_op(var_regs[i]);
+        saved_regs |= 1u << var_regs[i];
+    }
+    frame_size = 8 * __builtin_popcount(saved_regs);
+    for (int i = 1; i <= num_vars; i++) {
+        if (var_locs[i].kind != OPD_NONE)
+            continue;
+        frame_size += 8;
+        var_locs[i] = mem_op(RBP, -frame_size);
+    }
+}
+
+Operand var_loc(LVar *var) {
+    return var_locs[var->offset / 8];
+}
+
+void allocate_registers() {
+    build_intervals();
+
+    vreg_loc = realloc(vreg_loc, sizeof(Operand) * (num_vregs + 1));
+    order = realloc(order, sizeof(int) * (num_vregs + 1));
+    if (vreg_loc == NULL || order == NULL)
+        error("メモリを確保できません");
+
+    int n = 0;
+    for (int v = 1; v <= num_vregs; v++) {
+        vreg_loc[v] = vreg_tile[v];
+        if (start[v] >= 0 && vreg_tile[v].kind == OPD_NONE)
+            order[n++] = v;
+    }
+    qsort(order, n, sizeof(int), by_start);
+
+    unsigned free_regs = 0;
+    for (int i = 0; i < NUM_REGS; i++)
+        free_regs |= 1u << alloc_regs[i];
+    num_active = 0;
+    spill_size = 0;
+
+    int call = 0;
+    for (int i = 0; i <= n; i++) {
+        int pos = i < n ? start[order[i]] : num_irs;
+
+        // pos以前の呼び出しでは、その時点で割り当て中のレジスタを退避する
+        for (; call <= pos && call < num_irs; call++) {
+            if (irs[call].op != IR_CALL)
+                continue;
+            expire(call, &free_regs);
+            irs[call].saved = live_regs();
+        }
+        if (i == n)
+            break;
+
+        int v = order[i];
+        expire(pos, &free_regs);
+        if (free_regs) {
+            for (int r = 0; r < NUM_REGS; r++) {
+                if (free_regs & 1u << alloc_regs[r]) {
+                    free_regs &= ~(1u << alloc_regs[r]);
+                    vreg_loc[v] = reg_op(alloc_regs[r]);
+                    break;
+                }
+            }
+            add_active(v);
+            continue;
+        }
+
+        // 一番長く生きる区間を追い出す
+        int last = active[num_active - 1];
+        if (end[last] > end[v]) {
+            vreg_loc[v] = vreg_loc[last];
+            spill(last);
+            num_active--;
+            add_active(v);
+        } else {
+            spill(v);
+        }
+    }
+}
+
+// スレッドの作業領域を解放する
+void free_regalloc() {
+    free(var_locs);
+    free(hot);
+    var_locs = NULL;
+    hot = NULL;
+    free(vreg_loc);
+    free(start);
+    free(end);
+    free(order);
+    vreg_loc = NULL;
+    start = end = order = NULL;
+}
@@ -0,0 +1,216 @@
+#include "9cc.h"
+#include <pthread.h>
+#include <stdint.h>
+
+//
+// トークナイザの内側のループ
+// 空白・識別子・数字の連続を16/32バイトずつまとめて判定して読み飛ばす
+// 使えるなら実行時にAVX2を選び、x86-64以外ではスカラー版を使う
+//
+// 入力はNUL終端されていて、NULはどの種類にも含まれないので
+// 連続の終わりは必ず入力の中で見つかる。
+// SIMD版はアラインされたブロック単位で読むので、ページをまたいで
+// 入力の外を読むことはない。
+//
+
+static bool is_space(char c) {
+    return c == ' ' || ('\t' <= c && c <= '\r');
+}
+
+static bool is_digit(char c) {
+    return '0' <= c && c <= '9';
+}
+
+static bool is_alnum(char c) {
+    return ('a' <= c && c <= 'z') ||
+           ('A' <= c && c <= 'Z') ||
+           is_digit(c) || c == '_';
+}
+
+static char *skip_space_scalar(char *p) {
+    while (is_space(*p))
+        p++;
+    return p;
+}
+
+static char *skip_ident_scalar(char *p) {
+    while (is_alnum(*p))
+        p++;
+    return p;
+}
+
+static char *skip_digits_scalar(char *p) {
+    while (is_digit(*p))
+        p++;
+    return p;
+}
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+// lo <= x <= hi のバイトを0xffにする
+// 符号付き比較しかないので、x - lo を0x80ずらしてから比べる
+#define IN_RANGE16(x, lo, hi)                                                \
+    _mm_cmplt_epi8(_mm_add_epi8(x, _mm_set1_epi8((char)(0x80 - (lo)))),      \
+                   _mm_set1_epi8((char)((hi) - (lo) - 0x80 + 1)))
+
+#define IN_RANGE32(x, lo, hi)                                                \
+    _mm256_cmpgt_epi8(_mm256_set1_epi8((char)((hi) - (lo) - 0x80 + 1)),      \
+                      _mm256_add_epi8(x, _mm256_set1_epi8((char)(0x80 - (lo)))))
+
+static __m128i space16(__m128i v) {
+    return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), IN_RANGE16(v, '\t', '\r'));
+}
+
+static __m128i digit16(__m128i v) {
+    return IN_RANGE16(v, '0', '9');
+}
+
+static __m128i alnum16(__m128i v) {
+    // 0x20を立てると大文字が小文字になる
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i m = _mm_or_si128(IN_RANGE16(lower, 'a', 'z'), IN_RANGE16(v, '0', '9'));
+    return _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+}
+
+// classifyが0xffを返す間pを進める
+#define SCAN16(name, classify)                                               \
+    static char *name(char *p) {                                             \
+        uintptr_t off = (uintptr_t)p & 15;                                   \
+        __m128i *q = (__m128i *)(p - off);                                   \
+        unsigned mask = ~_mm_movemask_epi8(classify(_mm_load_si128(q)));     \
+        mask &= 0xffffu << off;                                              \
+        while (!(mask & 0xffff))                                             \
+            mask = ~_mm_movemask_epi8(classify(_mm_load_si128(++q)));        \
+        return (char *)q + __builtin_ctz(mask);                              \
+    }
+
+SCAN16(skip_space_sse2, space16)
+SCAN16(skip_ident_sse2, alnum16)
+SCAN16(skip_digits_sse2, digit16)
+
+__attribute__((target("avx2")))
+static __m256i space32(__m256i v) {
+    return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), IN_RANGE32(v, '\t', '\r'));
+}
+
+__attribute__((target("avx2")))
+static __m256i digit32(__m256i v) {
+    return IN_RANGE32(v, '0', '9');
+}
+
+__attribute__((target("avx2")))
+static __m256i alnum32(__m256i v) {
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i m = _mm256_or_si256(IN_RANGE32(lower, 'a', 'z'), IN_RANGE32(v, '0', '9'));
+    return _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+}
+
+#define SCAN32(name, classify)                                               \
+    __attribute__((target("avx2")))                                          \
+    static char *name(char *p) {                                             \
+        uintptr_t off = (uintptr_t)p & 31;                                   \
+        __m256i *q = (__m256i *)(p - off);                                   \
+        uint64_t mask = ~(uint32_t)_mm256_movemask_epi8(classify(_mm256_load_si256(q))); \
+        mask &= 0xffffffffu << off;                                          \
+        while (!(mask & 0xffffffffu))                                        \
+            mask = ~(uint32_t)_mm256_movemask_epi8(classify(_mm256_load_si256(++q))); \
+        return (char *)q + __builtin_ctzll(mask);                            \
+    }
+
+SCAN32(skip_space_avx2, space32)
+SCAN32(skip_ident_avx2, alnum32)
+SCAN32(skip_digits_avx2, digit32)
+#endif
+
+typedef struct {
+    char *name;
+    char *(*skip_space)(char *p);
+    char *(*skip_ident)(char *p);
+    char *(*skip_digits)(char *p);
+} Scanner;
+
+static Scanner scanners[] = {
+#ifdef __x86_64__
+    {"avx2", skip_space_avx2, skip_ident_avx2, skip_digits_avx2},
+    {"sse2", skip_space_sse2, skip_ident_sse2, skip_digits_sse2},
+#endif
+    {"scalar", skip_space_scalar, skip_ident_scalar, skip_digits_scalar},
+};
+
+// スレッドを始める前に選んでおく
+static Scanner *scanner;
+static pthread_once_t scanner_once = PTHREAD_ONCE_INIT;
+
+static bool supported(Scanner *sc) {
+#ifdef __x86_64__
+    if (!strcmp(sc->name, "avx2")) {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return true;
+}
+
+// 使うスキャナを名前で選ぶ。NULLならCPUが対応する一番速いもの
+void select_scanner(char *name) {
+    for (int i = 0; i < sizeof(scanners) / sizeof(*scanners); i++) {
+        Scanner *sc = &scanners[i];
+        if ((name == NULL || !strcmp(sc->name, name)) && supported(sc)) {
+            scanner = sc;
+            return;
+        }
+    }
+    error("スキャナ'%s'は使えません", name);
+}
+
+static void select_default() {
+    if (!scanner)
+        select_scanner(NULL);
+}
+
+static Scanner *get_scanner() {
+    pthread_once(&scanner_once, select_default);
+    return scanner;
+}
+
+char *scanner_name() {
+    return get_scanner()->name;
+}
+
+// 以下はトークナイザから呼ばれる
+// pは種類を判定済みの文字を指している
+// 短い連続はSIMDを呼ぶより1文字ずつ見たほうが速いので、
+// 最初のSHORT_RUNバイトはスカラーで確かめる
+#define SHORT_RUN 16
+
+char *skip_space(char *p) {
+    char *end = p + SHORT_RUN;
+    for (p++; p < end; p++)
+        if (!is_space(*p))
+            return p;
+    return get_scanner()->skip_space(p);
+}
+
+char *skip_ident(char *p) {
+    char *end = p + SHORT_RUN;
+    for (p++; p < end; p++)
+        if (!is_alnum(*p))
+            return p;
+    return get_scanner()->skip_ident(p);
+}
+
+// 10進数を読んでその値を返す。*endには数字の直後を入れる
+// 桁あふれは実行時の演算と同じく64bitで折り返す
+long read_decimal(char *p, char **end) {
+    char *q = p + 1;
+    while (q < p + SHORT_RUN && is_digit(*q))
+        q++;
+    if (q == p + SHORT_RUN)
+        q = get_scanner()->skip_digits(q);
+    unsigned long val = 0;
+    for (; p < q; p++)
+        val = val * 10 + (*p - '0');
+    *end = q;
+    return (long)val;
+}
@@ -0,0 +1,120 @@
+#include "9cc.h"
+#include <sys/resource.h>
+#include <time.h>
+
+//
+// --statsで出す統計
+// フェーズごとの時間と、作ったオブジェクトの数、出力の大きさを集める
+//
+
+_Thread_local Stats stats;
+
+static char *phase_name[] = {
+    [PHASE_READ] = "read",
+    [PHASE_TOKENIZE] = "tokenize",
+    [PHASE_PARSE] = "parse",
+    [PHASE_FOLD] = "fold",
+    [PHASE_LOWER] = "lower",
+    [PHASE_CODEGEN] = "codegen",
+    [PHASE_PEEPHOLE] = "peephole",
+    [PHASE_EMIT] = "emit",
+};
+
+static _Thread_local double wall[NUM_PHASES];
+static _Thread_local double cpu[NUM_PHASES];
+static _Thread_local bool in_phase[NUM_PHASES];
+
+static double clock_sec(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void begin_phase(Phase phase) {
+    in_phase[phase] = true;
+    wall[phase] -= clock_sec(CLOCK_MONOTONIC);
+    cpu[phase] -= clock_sec(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void end_phase(Phase phase) {
+    in_phase[phase] = false;
+    wall[phase] += clock_sec(CLOCK_MONOTONIC);
+    cpu[phase] += clock_sec(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+// エラーで途中から抜けたフェーズを閉じる
+void close_phases() {
+    for (int i = 0; i < NUM_PHASES; i++)
+        if (in_phase[i])
+            end_phase(i);
+}
+
+typedef struct {
+    char *name;
+    long count;
+    size_t size;
+} Objects;
+
+static long peak_rss_kb() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static void print_text(FILE *fp, Objects *objs, int nobjs) {
+    double total_wall = 0, total_cpu = 0;
+    fprintf(fp, "time:%17s %13s\n", "wall", "cpu");
+    for (int i = 0; i < NUM_PHASES; i++) {
+        fprintf(fp, "  %-10s %9.3f ms %9.3f ms\n", phase_name[i], wall[i] * 1e3, cpu[i] * 1e3);
+        total_wall += wall[i];
+        total_cpu += cpu[i];
+    }
+    fprintf(fp, "  %-10s %9.3f ms %9.3f ms\n", "total", total_wall * 1e3, total_cpu * 1e3);
+
+    fprintf(fp, "objects:\n");
+    for (int i = 0; i < nobjs; i++)
+        fprintf(fp, "  %-10s %10ld count %12zu bytes\n",
+                objs[i].name, objs[i].count, objs[i].count * objs[i].size);
+
+    fprintf(fp, "memory:\n  %-10s %10ld KB\n", "peak RSS", peak_rss_kb());
+    fprintf(fp, "output:\n  %-10s %10ld\n  %-10s %10ld\n  %-10s %10ld\n",
+            "insns", stats.insns, "lines", stats.lines, "bytes", stats.bytes);
+}
+
+static void print_json(FILE *fp, Objects *objs, int nobjs) {
+    fprintf(fp, "{\n  \"phases\": {\n");
+    for (int i = 0; i < NUM_PHASES; i++)
+        fprintf(fp, "    \"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}%s\n",
+                phase_name[i], wall[i] * 1e3, cpu[i] * 1e3, i < NUM_PHASES - 1 ? "," : "");
+    fprintf(fp, "  },\n  \"objects\": {\n");
+    for (int i = 0; i < nobjs; i++)
+        fprintf(fp, "    \"%s\": {\"count\": %ld, \"bytes\": %zu}%s\n",
+                objs[i].name, objs[i].count, objs[i].count * objs[i].size,
+                i < nobjs - 1 ? "," : "");
+    fprintf(fp, "  },\n  \"peak_rss_kb\": %ld,\n", peak_rss_kb());
+    fprintf(fp, "  \"output\": {\"insns\": %ld, \"lines\": %ld, \"bytes\": %ld}\n}\n",
+            stats.insns, stats.lines, stats.bytes);
+}
+
+// pathがNULLなら標準エラーに表で、そうでなければJSONでファイルに書く
+void print_stats(char *path) {
+    Objects objs[] = {
+        {"Token", stats.tokens, sizeof(Token)},
+        {"Node", stats.nodes, sizeof(Node)},
+        {"NDList", stats.ndlists, sizeof(NDList)},
+        {"LVar", stats.lvars, sizeof(LVar)},
+        {"IR", stats.irs, sizeof(IR)},
+    };
+    int nobjs = sizeof(objs) / sizeof(*objs);
+
+    if (path == NULL) {
+        print_text(stderr, objs, nobjs);
+        return;
+    }
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+        error("%s: %s", path, strerror(errno));
+    print_json(fp, objs, nobjs);
+    fclose(fp);
+}
@@ -0,0 +1,146 @@
+#include "9cc.h"
+
+//
+// ローカル変数の記号表
+// (名前, 長さ)をキーにしたオープンアドレス法のハッシュ表
+// 各スロットにはその名前で一番内側のスコープの変数が入り、
+// 外側の同名の変数はLVar.shadowでたどれる
+// 関数の中からは、ほかの関数で宣言した変数は見えない
+//
+
+typedef struct Scope Scope;
+struct Scope {
+    Scope *up;      // 外側のスコープ
+    LVar *vars;     // このスコープで宣言した変数(LVar.scope_nextでつなぐ)
+    int function;   // このスコープを含む関数の番号
+};
+
+// スコープを抜けて消した変数の跡
+#define TOMBSTONE ((LVar *)-1)
+
+static _Thread_local LVar **table;
+static _Thread_local int capacity;
+static _Thread_local int used;    // 変数か墓標が入っているスロットの数
+static _Thread_local Scope *scope;
+static _Thread_local int num_functions;
+
+// FNV-1a
+unsigned hash_name(char *name, int len) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// 名前に対応するスロットか、なければ挿入すべき空きスロットを返す
+static LVar **find_slot(char *name, int len, unsigned hash) {
+    LVar **tombstone = NULL;
+    for (unsigned i = hash;; i++) {
+        LVar **slot = &table[i & (capacity - 1)];
+        if (*slot == NULL)
+            return tombstone ? tombstone : slot;
+        if (*slot == TOMBSTONE) {
+            if (!tombstone)
+                tombstone = slot;
+            continue;
+        }
+        LVar *var = *slot;
+        if (var->hash == hash && var->len == len && !memcmp(var->name, name, len))
+            return slot;
+    }
+}
+
+// 墓標を取り除きつつ表を作り直す
+static void rehash() {
+    LVar **old = table;
+    int old_capacity = capacity;
+
+    int live = 0;
+    for (int i = 0; i < old_capacity; i++)
+        if (old[i] && old[i] != TOMBSTONE)
+            live++;
+
+    capacity = 16;
+    while (capacity < (live + 1) * 4)
+        capacity *= 2;
+    table = calloc(capacity, sizeof(LVar *));
+    used = 0;
+
+    for (int i = 0; i < old_capacity; i++) {
+        LVar *var = old[i];
+        if (var && var != TOMBSTONE) {
+            *find_slot(var->name, var->len, var->hash) = var;
+            used++;
+        }
+    }
+    free(old);
+}
+
+// 変数を名前で検索する。見つからなかった場合はNULLを返す。
+LVar *find_lvar(Token *tok) {
+    if (used == 0)
+        return NULL;
+    LVar *var = *find_slot(tok->str, tok->len, tok->hash);
+    if (var == NULL || var == TOMBSTONE || var->function != scope->function)
+        return NULL;
+    return var;
+}
+
+// 今のスコープに変数を登録する
+void declare_lvar(LVar *var) {
+    if ((used + 1) * 2 > capacity)
+        rehash();
+
+    var->hash = hash_name(var->name, var->len);
+    var->function = scope->function;
+    LVar **slot = find_slot(var->name, var->len, var->hash);
+    if (*slot == NULL)
+        used++;
+    else if (*slot != TOMBSTONE)
+        var->shadow = *slot;
+    *slot = var;
+
+    var->scope_next = scope->vars;
+    scope->vars = var;
+}
+
+// 前のプログラムの変数を全て忘れる
+void reset_symtab() {
+    if (table)
+        memset(table, 0, sizeof(LVar *) * capacity);
+    used = 0;
+    scope = NULL;
+    num_functions = 0;
+}
+
+void enter_scope() {
+    Scope *sc = arena_alloc(&symbol_arena, sizeof(Scope));
+    sc->up = scope;
+    sc->function = scope ? scope->function : num_functions++;
+    scope = sc;
+}
+
+// 関数の本体のスコープに入る。外側の変数はここから見えなくなる
+void enter_function_scope() {
+    enter_scope();
+    scope->function = num_functions++;
+}
+
+// スコープを抜けて、そこで宣言した変数を見えなくする
+void leave_scope() {
+    for (LVar *var = scope->vars; var; var = var->scope_next) {
+        LVar **slot = find_slot(var->name, var->len, var->hash);
+        *slot = var->shadow ? var->shadow : TOMBSTONE;
+    }
+    scope = scope->up;
+}
+
+// スレッドの作業領域を解放する
+void free_symtab() {
+    free(table);
+    table = NULL;
+    capacity = used = 0;
+    scope = NULL;
+}
@@ -3,15 +3,59 @@ assert() {
     expected="$1"
     input="$2"
 
-    ./9cc "$input" > tmp.s
+    echo "$input" | ./9cc - > tmp.s
     cc -o tmp tmp.s test_func.o
     ./tmp
     actual="$?"
 
+    if [ "$actual" != "$expected" ]; then
+        echo "$input => $expected expected, but got $actual"
+        exit 1
+    fi
+
+    # 組み込みのエンコーダで作ってその場で実行しても同じ結果になる
+    echo "$input" | ./9cc --run --load=./test_func.so -
+    actual="$?"
+
     if [ "$actual" = "$expected" ]; then
         echo "$input => $actual"
     else
-        echo "$input => $expected expected, but got $actual"
+        echo "$input => $expected expected, but got $actual (--run)"
+        exit 1
+    fi
+}
+
+# -cで出力したオブジェクトファイルをリンクして実行する
+assert_obj() {
+    expected="$1"
+    input="$2"
+
+    echo "$input" | ./9cc -c -o tmp.o -
+    cc -o tmp tmp.o test_func.o
+    ./tmp
+    actual="$?"
+
+    if [ "$actual" = "$expected" ]; then
+        echo "-c $input => $actual"
+    else
+        echo "-c $input => $expected expected, but got $actual"
+        exit 1
+    fi
+}
+
+assert_file() {
+    expected="$1"
+    file="$2"
+
+    ./9cc "$file" > tmp.s
+    cc -o tmp tmp.s test_func.o
+    ./tmp
+    actual="$?"
+
+    if [ "$actual" = "$expected" ]; then
+        echo "$file => $actual"
+    else
+        echo "$file => $expected expected, but got $actual"
         exit 1
     fi
 }
@@ -19,7 +63,7 @@ assert() {
 run_func() {
     input="$1"
 
-    ./9cc "$input" > tmp.s
+    echo "$input" | ./9cc - > tmp.s
     cc -o tmp tmp.s test_func.o
     ./tmp
 }
@@ -33,6 +77,8 @@ assert 15 "5*(9-6);"
 assert 4 "(3+5)/2;"
 assert 10 "-10+20;"
 assert 12 "-1*-(4-2)*6;"
+assert 10 "(1-2)-(3-(4+(5-9)))+(6-(7-8))*(9-(8-(7-6)));"
+assert 41 "((((1+2)*(3-4))-((5+6)*(7-8)))*(((9-8)+(7-6))-((5-4)+(3-2))))+((((1+2)-(3+4))*((5-6)+(7+8)))-(((9+8)*(7-6))-((5*4)-(3*2))))+100;"
 
 assert 1 "2==2;"
 assert 0 "2 == 44;"
@@ -57,6 +103,12 @@ assert 1 "foo = 1;"
 assert 5 "bar = 2 + 3;"
 assert 3 "foo = 1; bar = 2; foo + bar;"
 assert 1 "_A1z = 1;"
+assert 7 "returnx = 3; iff = 4; return returnx + iff;"
+assert 253 "x = 3; return 0 - x * 1 + 0;"
+assert 28 "x = 4; return x * 0 + x * 1 + (2 * x) * 3;"
+assert 5 "x = 5; return (x + 1) + 2 - 3;"
+assert 1 "x = 2; return x < 3;"
+assert 0 "x = 2; return 3 < x;"
 
 assert 1 "return 1; 2; 3;"
 assert 2 "1; return 2; 3;"
@@ -75,17 +127,335 @@ assert 20 "x = 0; for (i = 0; i < 10; i = i + 1) x = x + 2; return x;"
 assert 20 "x = 0; i = 0; for (; i < 10; i = i + 1) x = x + 2; return x;"
 assert 10 "for (i = 0; ; i = i + 1) return 10;"
 assert 10 "for (i = 0; i < 10; ) i = i + 1; return i;"
+assert 3 "for (x = 3; 0; ) x = 1; return x;"
+assert 7 "a = 7; for (b = 3; 0; ) a;"
+assert 9 "x = 9; while (0) x = 1; return x;"
+assert 7 "if (1) return 7; return 8;"
+
+# 条件の比較はcmpとjccで分岐する
+assert 4 "x = 0; for (i = 0; i <= 3; i = i + 1) x = x + 1; return x;"
+assert 5 "i = 10; while (i > 5) i = i - 1; return i;"
+assert 4 "i = 10; while (i >= 5) i = i - 1; return i;"
+assert 3 "i = 0; while (i != 3) i = i + 1; return i;"
+assert 2 "x = 3; if (x > 3) y = 1; else y = 2; return y;"
+assert 1 "x = 3; if (x >= 3) y = 1; else y = 2; return y;"
+assert 2 "x = 3; if (x != 3) y = 1; else y = 2; return y;"
+assert 1 "x = 0 - 2; if (x < 0) y = 1; else y = 2; return y;"
+assert 1 "x = 2; y = 5; if (x * 2 < y) z = 1; else z = 2; return z;"
+assert 3 "x = 1; y = x < 2; if (y) z = 3; else z = 4; return z;"
+actual=$(echo "i = 0; while (i < 10) i = i + 1; return i;" | ./9cc - | grep -c set)
+if [ "$actual" != "0" ]; then
+    echo "fused compare-and-branch => no setcc expected, but got $actual"
+    exit 1
+fi
+echo "fused compare-and-branch => ok"
+
+# ループは条件を末尾に置いて、1周に後ろへの条件付きジャンプ1つだけで回る
+assert 4 "x = 0; for (i = 0; i < 8; i = i + 2) { x = x + 1; } return x;"
+assert 5 "for (i = 0; ; i = i + 1) if (i == 5) return i; return 0;"
+assert 3 "i = 0; while (myadd(i, 0) < 3) i = i + 1; return i;"
+assert 0 "i = 5; while (i = i - 1) if (i < 0) i = 0; return i;"
+actual=$(echo "i = 0; while (i < 10) i = i + 1; return i;" | ./9cc - | grep -c -e jmp -e .p2align)
+if [ "$actual" != "1" ]; then
+    echo "loop rotation => one .p2align and no jmp expected"
+    exit 1
+fi
+echo "loop rotation => ok"
+
+# 1回しか使わない定数と変数はimm32や[rbp-N]のまま命令に埋め込む
+assert 6 "x = 1; return x + (x = 5);"
+assert 25 "x = 2; return (x = 5) * x;"
+assert 1 "x = 1; y = x; x = 7; return y;"
+assert 252 "x = 1; return x - myadd(x = 3, 4);"
+assert 5 "x = 1; return (x + 5000000000) / 1000000000;"
+assert 3 "x = 7; y = 2; return x / y;"
+assert 1 "x = 7; return 3 < x;"
+assert 4 "x = 7; y = x + 3; z = y - 6; return z;"
+actual=$(echo "x = 5; return x * 7;" | ./9cc - | grep -c -e "mov qword ptr \[rsp-8\], 5" -e "imul r10, 7")
+if [ "$actual" != "2" ]; then
+    echo "instruction selection => mov [rsp-8], 5 and imul r10, 7 expected"
+    exit 1
+fi
+echo "instruction selection => ok"
+
+# 定数での割り算と掛け算はシフトやleaや上位の掛け算にするので、
+# 変数で割った(idivの)結果と境界の値で突き合わせる
+# 負の数は0からの引き算で書く。minはINT64_MIN
+num() {
+    case "$1" in
+    min) echo "(0 - 9223372036854775807 - 1)" ;;
+    -*) echo "(0 - ${1#-})" ;;
+    *) echo "$1" ;;
+    esac
+}
+dividends="0 1 -1 2 -2 3 -3 7 -7 8 -8 99 -99 100 -100 4294967295 -4294967296 \
+    123456789012345 -987654321098765 4611686018427387904 \
+    9223372036854775807 -9223372036854775807 min"
+divisors="1 2 -2 3 -3 4 -4 5 6 7 -7 8 9 10 -10 11 16 -16 25 100 125 641 1000 -1000 \
+    65536 2147483647 2147483648 4294967297 6700417 1000000007 4611686018427387904 \
+    -4611686018427387904 3074457345618258602 9223372036854775807 -9223372036854775807 min"
+{
+    echo "n = 0;"
+    for x in $dividends; do
+        echo "x = $(num $x);"
+        for d in $divisors; do
+            d=$(num $d)
+            echo "y = $d; if (x / $d != x / y) n = n + 1; if (x * $d != x * y) n = n + 1;"
+        done
+    done
+    echo "return n != 0;"
+} > tmp-divmul.c
+assert_file 0 tmp-divmul.c
+./9cc --run tmp-divmul.c
+actual="$?"
+./9cc -c -o tmp.o tmp-divmul.c
+cc -o tmp tmp.o
+./tmp
+if [ "$actual$?" != "00" ]; then
+    echo "division and multiplication by constants => mismatch with idiv/imul (--run, -c)"
+    exit 1
+fi
+echo "division and multiplication by constants => ok"
+# 畳み込みをしなくても、定数での割り算と掛け算はidivやimulと同じになる
+./9cc --no-fold --run tmp-divmul.c
+actual="$?"
+./9cc --no-fold -c -o tmp.o tmp-divmul.c
+cc -o tmp tmp.o
+./tmp
+if [ "$actual$?" != "00" ]; then
+    echo "division and multiplication by constants (--no-fold) => mismatch with idiv/imul (--run, -c)"
+    exit 1
+fi
+echo "division and multiplication by constants (--no-fold) => ok"
 
 assert 3 "{ x = 1; y = 2; z = x + y; } return z;"
 assert 2 "if (1) {y = 1; y = y + 1;} return y;"
 assert 2 "{ x = 1; { x = x + 1; } }"
 assert 3 "{ x = 1; { x = x + 1; { x = x + 1; } } }"
 
+# 16バイトを超える空白・識別子・数字の連続はSIMDで読み飛ばす
+long_input="a_very_long_identifier_name_0123456789 =     000000000000000000042;                                   return a_very_long_identifier_name_0123456789;"
+scanners="scalar sse2"
+grep -q avx2 /proc/cpuinfo 2>/dev/null && scanners="$scanners avx2"
+for scanner in $scanners; do
+    echo "$long_input" | ./9cc --scanner=$scanner - > tmp.s
+    cc -o tmp tmp.s
+    ./tmp
+    actual="$?"
+    if [ "$actual" != 42 ]; then
+        echo "--scanner=$scanner: 42 expected, but got $actual"
+        exit 1
+    fi
+    echo "--scanner=$scanner => $actual"
+done
+
+# ファイルはメモリにマップして読む
+printf 'x = 40;\nreturn x + 2;\n' > tmp-file.c
+assert_file 42 tmp-file.c
+# 大きさがページちょうどのファイルでも末尾はNUL終端される
+{ printf 'return 7;'; head -c 4087 /dev/zero | tr '\0' ' '; } > tmp-page.c
+assert_file 7 tmp-page.c
+
+# --stats=FILEは統計をJSONで書き出す
+./9cc --stats=tmp-stats.json tmp-file.c > tmp.s
+if ! grep -q '"Token": {"count": 10,' tmp-stats.json; then
+    echo "--stats: Token count not found in tmp-stats.json"
+    exit 1
+fi
+echo "--stats => ok"
+
+# --dump-irはアセンブリの代わりにIRを出す
+expected="main:
+.B0:
+    v2 = 1
+    store x, v2
+    v3 = load x
+    v4 = 2
+    v5 = le v3, v4
+    br v5, .B1, .B2
+.B1:
+    v6 = 5
+    store x, v6
+    jmp .B2
+.B2:
+    v7 = load x
+    ret v7"
+actual=$(echo "x = 1; if (x < 3) x = 5; return x;" | ./9cc --dump-ir -)
+if [ "$actual" != "$expected" ]; then
+    echo "--dump-ir: unexpected output"
+    echo "$actual"
+    exit 1
+fi
+echo "--dump-ir => ok"
+
+# --no-foldなら1や-1での割り算もIRに残り、codegenで扱われる
+for d in "1 7" "-1 249"; do
+    set -- $d
+    input="x = 7; return x / $1;"
+    if ! echo "$input" | ./9cc --dump-ir --no-fold - | grep -q " = div "; then
+        echo "--dump-ir --no-fold $input => div expected in the IR"
+        exit 1
+    fi
+    echo "$input" | ./9cc --no-fold --run -
+    actual="$?"
+    if [ "$actual" != "$2" ]; then
+        echo "--no-fold $input => $2 expected, but got $actual"
+        exit 1
+    fi
+    echo "--no-fold $input => $actual"
+done
+
+assert_obj 42 "x = 40; return x + 2;"
+assert_obj 10 "a = 0; for (i = 0; i < 5; i = i + 1) a = a + i; return a;"
+assert_obj 6 "a = 0; for (i = 9; i >= 0; i = i - 1) if (i != 4) if (i > 2) a = a + 1; return a;"
+assert_obj 1 "x = 5000000000; return x / 5000000000;"
+assert_obj 9 "a = 3; b = a + 4; c = b - 2; if (10 > c) c = c + a * 2; return c / b * 9;"
+assert_obj 6 "return myadd3(1, 2, 3);"
+assert_obj 12 "x = 2; return x * myadd(x, 3) + myadd(x, 0);"
+assert_obj 55 "fib(n) { if (n <= 1) return n; return fib(n - 1) + fib(n - 2); } return fib(10);"
+
+# 1つのプロセスで複数のプログラムをコンパイルする
+printf 'return 3;\n' > tmp-unit1.c
+printf 'a = 2; while (a < 10) a = a * 2; return a;\n' > tmp-unit2.c
+printf 'tmp-unit1.c\ntmp-unit2.c\n' > tmp-manifest
+./9cc --batch=tmp-manifest 2> /dev/null
+for unit in "tmp-unit1 3" "tmp-unit2 16"; do
+    set -- $unit
+    cc -o tmp $1.s
+    ./tmp
+    actual="$?"
+    if [ "$actual" != "$2" ]; then
+        echo "--batch $1.c => $2 expected, but got $actual"
+        exit 1
+    fi
+    echo "--batch $1.c => $actual"
+done
+# peepholeの統計はプログラムごとに数える
+cp tmp-unit1.c tmp-unit2.c
+actual=$(./9cc --peephole-stats --batch=tmp-manifest 2>&1 | grep total | uniq | wc -l)
+if [ "$actual" != "1" ]; then
+    echo "--peephole-stats --batch => same totals for identical units expected"
+    exit 1
+fi
+echo "--peephole-stats --batch => ok"
+actual=$(printf 'return 3;\0x = 4; return x * x;' | ./9cc --run --batch0 2> /dev/null | tr '\n' ' ')
+if [ "$actual" != "3 16 " ]; then
+    echo "--batch0 => 3 16 expected, but got $actual"
+    exit 1
+fi
+echo "--batch0 => $actual"
+
+# エラーのあるプログラムは名前を付けて報告し、残りはコンパイルを続ける
+printf 'a = 2; while (a < 10) a = a * 2; return a;\n' > tmp-unit2.c
+printf 'return 1 +;\n' > tmp-unit3.c
+printf 'tmp-unit1.c\ntmp-unit3.c\ntmp-unit2.c\n' > tmp-manifest
+./9cc --run --batch=tmp-manifest > tmp-out 2> tmp-err
+status="$?"
+actual=$(tr '\n' ' ' < tmp-out)
+if [ "$status" = 0 ] || [ "$actual" != "tmp-unit1.c: 3 tmp-unit3.c: error tmp-unit2.c: 16 " ] ||
+    ! grep -q '^tmp-unit3.c: ' tmp-err; then
+    echo "--batch with an error => tmp-unit3.c reported and the others compiled expected, but got $actual (status $status)"
+    exit 1
+fi
+echo "--batch with an error => $actual"
+printf 'return 3;\0return 1 +;\0x = 4; return x * x;' | ./9cc --run --batch0 > tmp-out 2> /dev/null
+status="$?"
+actual=$(tr '\n' ' ' < tmp-out)
+if [ "$status" = 0 ] || [ "$actual" != "3 error 16 " ]; then
+    echo "--batch0 with an error => 3 error 16 expected, but got $actual (status $status)"
+    exit 1
+fi
+echo "--batch0 with an error => $actual"
+
+# libnineccを4スレッドから同時に使っても出力が変わらず、エラーで終了しない
+if ! ./bench/threads -n 400 -t 4 > /dev/null; then
+    echo "libninecc threads => failed"
+    exit 1
+fi
+echo "libninecc threads => ok"
+
 run_func "foo();"
 assert 3 "return myadd(1, 2);"
 assert 6 "return myadd(1, 2 + 3);"
 assert 6 "return myadd(1, myadd(2, 3));"
 assert 10 "return myadd(1, myadd(myadd(2, 4), 3));"
+assert 11 "return 1 + myadd(2, 3) * 2;"
+assert 12 "x = 2; return x * myadd(x, 3) + x;"
+
+# 関数定義
+assert 7 "add(a, b) { return a + b; } return add(3, 4);"
+assert 55 "fib(n) { if (n <= 1) return n; return fib(n - 1) + fib(n - 2); } return fib(10);"
+assert 21 "f(a, b, c, d, e, g) { return a + b * 2 + c * 3 + d * 4 + e * 5 + g * 6; } return f(1, 1, 1, 1, 1, 1);"
+assert 6 "x = 5; f() { x = 1; return x; } return x + f();"
+assert 42 "main() { return 42; }"
+assert 8 "g(x) { return myadd(x, x); } return g(4);"
+assert 3 "one() { return 1; } two() { return one() + one(); } return one() + two();"
+assert 4 "last(x) { x * 2; } return last(2);"
+assert 36 "big(n) { a0 = n; a1 = a0 + 1; a2 = a1 + 1; a3 = a2 + 1; a4 = a3 + 1; a5 = a4 + 1; a6 = a5 + 1; a7 = a6 + 1; a8 = a7 + 1; a9 = a8 + 1; b0 = a9 + 1; b1 = b0 + 1; b2 = b1 + 1; b3 = b2 + 1; b4 = b3 + 1; b5 = b4 + 1; b6 = b5 + 1; return b6 + a0; } return big(10);"
+
+# 7個目以降の引数はスタックに積んで渡す
+assert 204 "return weigh8(1, 2, 3, 4, 5, 6, 7, 8);"
+assert 54 "x = 3; return x + weigh8(1, 0, 0, 0, 0, 0, 0, 2) * x;"
+assert 204 "return weigh8(myadd(1, 0), 2, 3, 4, 5, 6, 7, weigh8(0, 0, 0, 0, 0, 0, 0, 1));"
+assert 23 "f(a, b, c, d, e, g, h, i, j) { return a - b + c - d + e - g + h * 2 - i * 3 + j * 4; } return f(1, 2, 3, 4, 5, 6, 7, 8, 9);"
+assert 8 "h(a, b, c, d, e, f, g) { return a + g; } k(x) { return h(x, 2, 3, 4, 5, 6, 7); } return k(1);"
+assert_obj 204 "x = 8; return weigh8(1, 2, 3, 4, 5, 6, 7, x);"
+# 定数と変数の引数はpushとpopを経由せずにレジスタに読み込む
+actual=$(echo "x = 1; y = myadd3(x, 2, 3); return y;" | ./9cc - | grep -e push -e pop | grep -vc rbp)
+if [ "$actual" != "0" ]; then
+    echo "args => no push/pop expected"
+    exit 1
+fi
+echo "args => ok"
+
+# 呼び出しの時点でrspが16バイトに揃っている
+assert 1 "return stack_aligned();"
+assert 2 "a = 1; b = stack_aligned(); return a + b;"
+assert 4 "a = myadd(1, 0); b = myadd(1, 0); c = stack_aligned(); return a + b + c + stack_aligned() - 1 + 1;"
+assert 3 "f(x) { return stack_aligned() + x; } return f(0) + f(1);"
+assert 2 "f(a, b, c, d, e, g, h) { return stack_aligned(); } return f(1, 2, 3, 4, 5, 6, 7) + f(1, 2, 3, 4, 5, 6, 7, 8);"
+
+# よく使う変数はcallee-savedのレジスタに置く
+assert 45 "s = 0; for (i = 0; i < 10; i = i + 1) s = s + i; return s;"
+assert 100 "s = 0; for (i = 0; i < 10; i = i + 1) s = myadd(s, 10); return s;"
+assert 55 "fib(n) { if (n <= 1) return n; a = fib(n - 1); b = fib(n - 2); c = a + b; return a + b + c - c; } return fib(10);"
+assert 36 "a = 1; b = 2; c = 3; d = 4; e = 5; f = 6; g = 7; h = 8; for (i = 0; i < 2; i = i + 1) { a = a + 0; b = b + 0; c = c + 0; d = d + 0; e = e + 0; f = f + 0; g = g + 0; h = h + 0; } return a + b + c + d + e + f + g + h;"
+assert 30 "f(a, b, c, d, e, g, h, k) { s = 0; for (i = 0; i < 2; i = i + 1) s = s + h + k; return s + a + b + c + d + e + g - 21; } return f(1, 2, 3, 4, 5, 6, 7, 8);"
+assert 2 "f(n) { s = 0; t = 0; for (i = 0; i < n; i = i + 1) { s = s + i; t = t + stack_aligned(); } return t; } return f(2);"
+assert 12 "g(x) { return x * 2; } f(n) { s = 0; for (i = 0; i < n; i = i + 1) s = s + i; return g(s); } return f(4);"
+assert_obj 100 "s = 0; for (i = 0; i < 10; i = i + 1) s = myadd(s, 10); return s;"
+actual=$(echo "s = 0; for (i = 0; i < 10; i = i + 1) s = s + i; return s;" | ./9cc - | grep -c -e "\[rsp" -e "\[rbp")
+if [ "$actual" != "0" ]; then
+    echo "promoted locals => no memory access expected"
+    exit 1
+fi
+echo "promoted locals => ok"
+
+# return f(...)はcallを重ねずにjmpする。自分自身の呼び出しはループになる
+# 1000万段の再帰は、呼び出しのたびにスタックを使うとあふれる
+assert 64 "sum(n, acc) { if (n == 0) return acc; return sum(n - 1, acc + n); } s = sum(10000000, 0); return s - s / 256 * 256;"
+assert 21 "gcd(a, b) { if (b == 0) return a; return gcd(b, a - a / b * b); } return gcd(1071, 462);"
+assert 1 "even(n) { if (n == 0) return 1; return odd(n - 1); } odd(n) { if (n == 0) return 0; return even(n - 1); } return odd(10000001);"
+assert 14 "h(a, b, c, d, e, f, g) { return a + b + c + d + e + f + g; } k(x) { return h(x, x, x, x, x, x, x); } return k(2);"
+assert 5 "f(x) { return myadd(x, 2); } return f(3);"
+assert_obj 1 "even(n) { if (n == 0) return 1; return odd(n - 1); } odd(n) { if (n == 0) return 0; return even(n - 1); } return even(10000000);"
+actual=$(echo "f(n) { if (n == 0) return 0; return g(n - 1); } g(n) { return f(n); } return 0;" | ./9cc - | grep -c -e "^    call" -e "^    jmp [fg]$")
+if [ "$actual" != "2" ]; then
+    echo "tail call => jmp g and jmp f without call expected"
+    exit 1
+fi
+echo "tail call => ok"
 
+# --peephole-statsは規則ごとに消した命令数と、その合計を出す
+stats=$(echo "x = 1; y = x; return y;" | ./9cc --peephole-stats - 2>&1 > /dev/null)
+sum=$(echo "$stats" | awk '$1 != "peephole:" && $1 != "total" { n += $2 } END { print n + 0 }')
+total=$(echo "$stats" | awk '$1 == "total" { print $2 }')
+before=$(echo "$stats" | awk '$1 == "total" { print $4 }')
+if [ -z "$total" ] || [ "$sum" != "$total" ] || [ "$total" -gt "$before" ]; then
+    echo "--peephole-stats => per-rule counts adding up to the total expected, but got"
+    echo "$stats"
+    exit 1
+fi
+echo "--peephole-stats => $total / $before"
 
 echo OK
\ No newline at end of file
@@ -16,3 +16,14 @@ int call_myadd() {
     myadd (1, 2);
     return myadd3(1, 2, 3);
 }
+
+// 呼び出された時点でrspが16バイトに揃っていれば1を返す
+// 揃っていればpush rbpの後のrbpは16の倍数になる
+int stack_aligned() {
+    return ((long)__builtin_frame_address(0) & 15) == 0;
+}
+
+// 引数の順番を取り違えると違う値になる
+int weigh8(int a, int b, int c, int d, int e, int f, int g, int h) {
+    return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h;
+}
@@ -1,169 +1,220 @@
 #include "9cc.h"
+#include <pthread.h>
 
-static char *user_input;
+static _Thread_local char *user_input;
+static _Thread_local char *input_name;   // エラー表示に使うファイル名
 
 
 static Token *new_token(TokenKind kind, Token *cur, char *str);
 
-int is_alnum(char c) {
-    return  ('a' <= c && c <= 'z') ||
-            ('A' <= c && c <= 'Z') ||
-            ('0' <= c && c <= '9') ||
-            (c == '_'); 
+// 文字の種類
+enum {
+    C_SPACE = 1,    // 空白文字
+    C_ALPHA = 2,    // 識別子の先頭に使える文字
+    C_DIGIT = 4,    // 数字
+    C_PUNCT = 8,    // 1文字の記号
+};
+
+static unsigned char char_class[256];
+
+// キーワードの表
+// 識別子を読み終えてから、長さと先頭の文字で候補を絞って照合する
+static struct {
+    char *name;
+    TokenKind kind;
+} keywords[] = {
+    {"return", TK_RETURN},
+    {"if", TK_IF},
+    {"else", TK_ELSE},
+    {"while", TK_WHILE},
+    {"for", TK_FOR},
+};
+
+#define NUM_KEYWORDS (int)(sizeof(keywords) / sizeof(*keywords))
+#define MAX_KEYWORD_LEN 8
+
+// keyword_index[長さ][先頭の文字]: keywordsの添字+1 (0なら候補なし)
+// 長さと先頭の文字が同じキーワードはkeyword_nextでつなぐ
+static unsigned char keyword_index[MAX_KEYWORD_LEN + 1][256];
+static unsigned char keyword_next[NUM_KEYWORDS];
+
+static void init_tables() {
+    for (char *p = " \t\n\v\f\r"; *p; p++)
+        char_class[(unsigned char)*p] = C_SPACE;
+    for (int c = 'a'; c <= 'z'; c++)
+        char_class[c] = C_ALPHA;
+    for (int c = 'A'; c <= 'Z'; c++)
+        char_class[c] = C_ALPHA;
+    char_class['_'] = C_ALPHA;
+    for (int c = '0'; c <= '9'; c++)
+        char_class[c] = C_DIGIT;
+    for (char *p = "+-*/();{},<>="; *p; p++)
+        char_class[(unsigned char)*p] = C_PUNCT;
+
+    for (int i = 0; i < NUM_KEYWORDS; i++) {
+        int len = strlen(keywords[i].name);
+        unsigned char *head = &keyword_index[len][(unsigned char)keywords[i].name[0]];
+        keyword_next[i] = *head;
+        *head = i + 1;
+    }
+}
+
+// 識別子がキーワードならその種類を、そうでなければTK_IDENTを返す
+static TokenKind keyword_kind(char *s, int len) {
+    if (len > MAX_KEYWORD_LEN)
+        return TK_IDENT;
+    for (int i = keyword_index[len][(unsigned char)*s]; i; i = keyword_next[i - 1])
+        if (!memcmp(keywords[i - 1].name, s, len))
+            return keywords[i - 1].kind;
+    return TK_IDENT;
 }
 
 // 入力文字列をトークナイズしてそれを返す
-Token *tokenize(char *p) {
+Token *tokenize(char *filename, char *p) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, init_tables);
+    input_name = filename;
     user_input = p;
     Token head;
     head.next = NULL;
     Token *cur = &head;
 
     while (*p) {
-        // 空白文字をスキップ
-        if (isspace(*p)) {
-            p++;
-            continue;
-        }
+        int c = char_class[(unsigned char)*p];
 
-        // handle < <= > >=
-        if (strchr("<>", *p)) {
-            if (strchr("=", *(p + 1))) {
-                cur = new_token(TK_RESERVED, cur, p);
-                p = p + 2;
-                cur->len = 2;                
-            } else {
-                cur = new_token(TK_RESERVED, cur, p++);
-                cur->len = 1;
-            }
-            continue;
-        }
-
-        // handle == != =
-        if (*p == '=') {
-            if(*(p + 1) == '=') {
-                cur = new_token(TK_RESERVED, cur, p);
-                p = p + 2;
-                cur->len = 2;
-                continue;
-            } else {
-                cur = new_token(TK_RESERVED, cur, p++);
-                cur->len = 1;
-                continue;
-            }
-        }
-        if (*p == '!') {
-            cur = new_token(TK_RESERVED, cur, p);
-            p = p + 2;
-            cur->len = 2;
+        // 空白文字をスキップ
+        if (c & C_SPACE) {
+            p = skip_space(p);
             continue;
         }
 
-        if (strchr("+-*/();{},", *p)) {
-            cur = new_token(TK_RESERVED, cur, p++); // p++の返り値は++する前のポインタ。charの値ではない。
-            cur->len = 1;
+        // 識別子とキーワード
+        // 変数の文字列は"a-zA-Z_"で始まり、先頭以外はそれに加え数値もOK
+        if (c & C_ALPHA) {
+            char *start = p;
+            p = skip_ident(p);
+            int len = p - start;
+            TokenKind kind = keyword_kind(start, len);
+            cur = new_token(kind, cur, start);
+            cur->len = len;
+            if (kind == TK_IDENT)
+                cur->hash = hash_name(start, len);
             continue;
         }
 
-        // return
-        // returnで始まり、変数でない場合
-        if (strncmp(p, "return", 6) == 0 && !is_alnum(p[6])) {
-            cur = new_token(TK_RETURN, cur, p);
-            cur->len = 6;
-            p += 6;
+        if (c & C_DIGIT) {
+            cur = new_token(TK_NUM, cur, p);
+            char *start = p;
+            cur->val = read_decimal(p, &p);
+            cur->len = p - start;
             continue;
         }
 
-        if (strncmp(p, "if", 2) == 0 && !is_alnum(p[2])) {
-            cur = new_token(TK_IF, cur, p);
+        // handle == != <= >=
+        if (p[1] == '=' && (*p == '=' || *p == '!' || *p == '<' || *p == '>')) {
+            cur = new_token(TK_RESERVED, cur, p);
             cur->len = 2;
             p += 2;
             continue;
         }
 
-        if (strncmp(p, "else", 4) == 0 && !is_alnum(p[4])) {
-            cur = new_token(TK_ELSE, cur, p);
-            cur->len = 4;
-            p += 4;
-            continue;
-        }
-
-        if (strncmp(p, "while", 5) == 0 && !is_alnum(p[5])) {
-            cur = new_token(TK_WHILE, cur, p);
-            cur->len = 5;
-            p += 5;
-            continue;
-        }
-
-        if (strncmp(p, "for", 3) == 0 && !is_alnum(p[3])) {
-            cur = new_token(TK_FOR, cur, p);
-            cur->len = 3;
-            p += 3;
-            continue;
-        }
-
-        // variables
-        // 文字列をトークンに追加
-        // 変数の文字列は"a-zA-Z_"で始まり、先頭以外はそれに加え数値もOK
-        if (('a' <= *p && *p <= 'z') ||
-            ('A' <= *p && *p <= 'Z') ||
-            (*p == '_')) {
-            char *start;
-            start = p;
-            while (is_alnum(*p)) {
-                p++;
-            }
-            cur = new_token(TK_IDENT, cur, start);
-            cur->len = p - start;
-            continue;
-        }
-
-        if (isdigit(*p)) {
-            cur = new_token(TK_NUM, cur, p);
-            cur->val = strtol(p, &p, 10);
+        if (c & C_PUNCT) {
+            cur = new_token(TK_RESERVED, cur, p++); // p++の返り値は++する前のポインタ。charの値ではない。
+            cur->len = 1;
             continue;
         }
 
         error_at(p, "トークナイズできません");
-
     }
 
     new_token(TK_EOF, cur, p);
     return head.next;
 }
 
+//
+// エラーの報告
+// メッセージはerror_messageに組み立てる。error_jmpが設定されていれば
+// (ライブラリから呼ばれた場合)そこへ戻り、なければ標準エラーに出して終了する
+//
+
+_Thread_local jmp_buf *error_jmp;
+_Thread_local char error_message[ERROR_MAX];
+static _Thread_local int error_len;
+
+static int vappend_error(char *fmt, va_list ap) {
+    int n = vsnprintf(error_message + error_len, ERROR_MAX - error_len, fmt, ap);
+    error_len += n;
+    if (error_len >= ERROR_MAX)
+        error_len = ERROR_MAX - 1;
+    return n;
+}
+
+static int append_error(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vappend_error(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+static _Noreturn void fail() {
+    if (error_jmp)
+        longjmp(*error_jmp, 1);
+    fprintf(stderr, "%s\n", error_message);
+    exit(1);
+}
+
 // エラー箇所を報告する
 // printfと同じ引数を取る 
 // ...は可変長引数を表すCの文法。stdarg.hと一緒に使うのが一般的のようだ。
+// 以下のような形式で、locを含む行とその位置を示す
+//
+// foo.c:10: x = y + + 5;
+//                   ^ 式ではありません
 void error_at(char *loc, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
 
-    int pos = loc - user_input;
-
-    fprintf(stderr, "%s\n", user_input);
-    fprintf(stderr, "%*s", pos, " "); // pos個の空白を出力
-    fprintf(stderr, "^ ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    // locが含まれている行の開始位置と終了位置を取得
+    char *line = loc;
+    while (user_input < line && line[-1] != '\n')
+        line--;
+    char *end = loc;
+    while (*end && *end != '\n')
+        end++;
+
+    // 見つかった行が全体の何行目なのかを調べる
+    int line_num = 1;
+    for (char *p = user_input; p < line; p++)
+        if (*p == '\n')
+            line_num++;
+
+    error_len = 0;
+    int indent = append_error("%s:%d: ", input_name, line_num);
+    append_error("%.*s\n", (int)(end - line), line);
+
+    int pos = loc - line + indent;
+    append_error("%*s^ ", pos, ""); // pos個の空白を出力
+    vappend_error(fmt, ap);
+    va_end(ap);
+    fail();
 }
 
 void error(char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-
-    fprintf(stderr, "%s\n", user_input);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    error_len = 0;
+    vappend_error(fmt, ap);
+    va_end(ap);
+    fail();
 }
 
 // 新しいトークンを作成してcurに繋げる
 static Token *new_token(TokenKind kind, Token *cur, char *str) {
-    Token *tok = calloc(1, sizeof(Token));
+    Token *tok = arena_alloc(&token_arena, sizeof(Token));
     tok->kind = kind;
     tok->str = str;
     cur->next = tok;
+    stats.tokens++;
     return tok;
 }